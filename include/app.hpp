@@ -3,11 +3,22 @@
 
 #include <vector>
 #include <string>
+#include <memory>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <cstdio>
 
 #include <fmt/core.h>
 #include <fmt/color.h>
 
 #include "zip.hpp"
+#include "thread_pool.hpp"
+#include "cache.hpp"
+#include "utils.hpp"
+#include "jpeg.hpp"
+#include "png.hpp"
+#include "fixes.hpp"
 
 class App {
 public:
@@ -15,27 +26,111 @@ public:
 
 	void print_info();
 
-	enum class Fix : unsigned {
-		None = 0,
-		All = ~0u,
+	using Fix = ::Fix;
 
-		Series = 1 << 0,
-	};
+	// Entries of book done and their total, called from threads of pool
+	using Progress = std::function<void(size_t done, size_t total)>;
+
+	// Settings from command line options without files for repack(), entries
+	// are compressed on given pool. Messages are printed as by command line
+	// tool ("-s" silences them). Throws std::runtime_error on invalid option.
+	void configure(std::vector<std::string> const& options, ThreadPool& pool);
+
+	// Repacked archive of book in memory
+	std::string repack(std::string_view epub, Progress const& progress);
+
+	// Keep cache within --cache-size, after last book
+	void trim_cache();
 
 private:
 	std::vector<std::string> files_;
 	std::string output_pattern_ = "{NAME}.epub";
 	int log_level_ = 1;
 	bool color_ = true;
+	// Messages go to stderr when archive is written to stdout
+	std::FILE* log_ = stdout;
 	bool repack_ = true;
 	int iterations_ = 16;
+	std::string profile_ = "balanced";
+	CompressOptions compress_options_;
+	// MIME type ("image/jpeg" or "image/*") and its options, last match wins
+	std::vector<std::pair<std::string, CompressOptions>> overrides_;
+	int jobs_ = 1;
+	int split_size_ = 0;
+	int in_flight_ = 1;
+	bool png_ = false;
+	ImageStrip png_strip_ = ImageStrip::Safe;
+	bool jpeg_ = false;
+	ImageStrip jpeg_strip_ = ImageStrip::Safe;
+	bool jpeg_progressive_ = false;
+	bool minify_ = false;
+	bool dedupe_ = false;
+	bool fonts_ = false;
+	bool force_ = false;
+	bool estimate_ = false;
+	int sample_ = 0;  // percent of entries compressed by estimate()
+	double time_budget_ = 0.0;        // seconds per book, 0 is unlimited
+	double total_time_budget_ = 0.0;  // seconds per run, 0 is unlimited
+	std::string cache_dir_;
+	int cache_size_ = 1024;
 	unsigned fixes_ = ~0u;
 
+	ThreadPool* pool_ = nullptr;
+	std::unique_ptr<ThreadPool> own_pool_;
+	// Options come from configure(), errors are thrown instead of printed
+	bool library_ = false;
+	std::unique_ptr<Cache> cache_;
+
+	// Settings recorded in book marker, see provenance.hpp
+	std::string provenance_;
+
+	std::chrono::steady_clock::time_point run_start_;
+	// Measured speed of zopfli, predicts whether entry fits into time budget
+	std::atomic<uint64_t> zopfli_work_{0};  // bytes * iterations
+	std::atomic<uint64_t> zopfli_time_{0};  // nanoseconds
+
 	int args(int argc, char** argv);
 
-	void fix_series(Zip& zip);
+	void prepare();
+
+	struct Book;
+
+	void run_pipeline();
+
+	void estimate();
+
+	CompressOptions const& compress_options(std::string_view file_name) const;
+
+	double zopfli_seconds(size_t size, int iterations) const;
+
+	std::string output_path(std::string const& file);
+
+	std::unique_ptr<Book> load_book(std::string const& file);
+
+	// Book from standard input repacked to standard output ("-" as file)
+	void repack_stdin();
+
+	void start_book(Book& book);
+
+	void fix_book(Documents& documents);
+
+	void dedupe_resources(Zip& zip, std::string const& rootfile);
+
+	void subset_fonts(Zip& zip, std::string const& rootfile);
+
+	void compress_zip(Book& book);
+
+	std::string image_id(std::string_view file_name) const;
+
+	void optimize_image(Book& book, size_t i, std::chrono::steady_clock::time_point deadline);
+
+	std::string minify_id(std::string_view file_name) const;
+
+	void minify_entry(Book& book, size_t i, bool collapse_spaces);
+
+	bool compress_zopfli(Book& book, size_t i, std::string_view content, CompressOptions const& options, bool split, std::chrono::steady_clock::time_point deadline);
 
-	void save_zip(Zip& zip, std::string const& filename);
+	void save_zip(Book& book);
 
 public:
 	// clang-format off
@@ -43,7 +138,7 @@ public:
 	template<typename S, typename... Args>
 	inline void xprint(int level, const S& format_str, const Args&... args) {
 		if(log_level_ > 0 && level <= log_level_) {
-			fmt::print(format_str, args...);
+			fmt::print(log_, format_str, args...);
 		}
 	}
 
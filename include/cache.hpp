@@ -0,0 +1,39 @@
+#ifndef HEADER_CACHE_HPP
+#define HEADER_CACHE_HPP
+
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+#include "filesystem.hpp"
+
+// Persistent cache of compressed streams.
+//
+// Every value is stored in its own file named by hash of key, so several
+// processes can share one directory: values are written to temporary file
+// and renamed into place, readers verify checksum of what they got.
+// Access time is tracked by file modification time and trim() removes least
+// recently used values above size limit.
+class Cache {
+public:
+	Cache(std::string const& dir, uint64_t max_size);
+
+	// Key of data compressed with given settings (see compress_id()).
+	static std::string key(std::string_view data, std::string_view settings);
+
+	// Key of already compressed zip entry, lets to skip its decompression.
+	static std::string stream_key(std::string_view stream, uint32_t crc, uint32_t size, std::string_view settings);
+
+	bool get(std::string const& key, std::string& value);
+	void put(std::string const& key, std::string_view value);
+
+	void trim();
+
+private:
+	fs::path dir_;
+	uint64_t max_size_;
+
+	fs::path path(std::string const& key) const;
+};
+
+#endif /* HEADER_CACHE_HPP */
@@ -0,0 +1,16 @@
+#ifndef HEADER_CSS_HPP
+#define HEADER_CSS_HPP
+
+#include <string>
+#include <string_view>
+
+// Style sheet without comments and whitespace that doesn't separate tokens.
+// Strings, url() and escapes are copied as they are, comments starting with
+// "/*!" are kept. Returns empty string if comment or string is unterminated.
+std::string minify_css(std::string_view css);
+
+// Style sheet may change how whitespace of XHTML is rendered (white-space
+// property or inline display), so it can't be collapsed.
+bool css_affects_spaces(std::string_view css);
+
+#endif /* HEADER_CSS_HPP */
@@ -0,0 +1,82 @@
+#ifndef HEADER_FIXES_HPP
+#define HEADER_FIXES_HPP
+
+#include <map>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "zip.hpp"
+#include "xml.hpp"
+
+enum class Fix : unsigned {
+	None = 0,
+	All = ~0u,
+
+	Series = 1 << 0,
+};
+
+// Documents of book shared by all fixes. Every entry is loaded and parsed at
+// most once, changed ones are written back to their entries by commit().
+//
+// Fixes running in parallel may use only documents they declared, those are
+// loaded by load() before they start, so cache isn't changed meanwhile.
+class Documents {
+public:
+	explicit Documents(Zip& zip);
+
+	// Path of package document from META-INF/container.xml, empty if there
+	// is none
+	std::string const& rootfile();
+
+	// Load entries into cache, missing ones are skipped
+	void load(std::vector<std::string> const& paths);
+
+	// Text of entry, nullptr if book has no such entry. Call changed() after
+	// modifying it.
+	std::string* text(std::string const& path);
+
+	// Document parsed from text with XML::raw_options, nullptr if entry is
+	// missing or isn't well-formed. Call changed() after modifying it.
+	XML* xml(std::string const& path);
+
+	void changed(std::string const& path);
+
+	// Write changed documents to their entries, returns their paths
+	std::vector<std::string> commit();
+
+private:
+	struct Document {
+		File* file = nullptr;
+		std::string text;
+		std::unique_ptr<XML> xml;
+		bool parsed = false;
+		bool changed = false;
+	};
+
+	Zip& zip_;
+	bool has_rootfile_ = false;
+	std::string rootfile_;
+	std::map<std::string, Document> documents_;
+
+	Document* find(std::string const& path);
+};
+
+struct Fixer {
+	Fix fix;
+	std::string_view name;         // value of --fix
+	std::string_view description;  // in help of --fix
+
+	// Paths of documents fix reads or changes. Fixes with disjoint documents
+	// run in parallel.
+	std::vector<std::string> (*documents)(Documents& documents);
+
+	// Apply fix to its documents, returns false if nothing changed
+	bool (*apply)(Documents& documents, std::vector<std::string> const& paths);
+};
+
+// All fixes in order they are applied
+std::vector<Fixer> const& fixers();
+
+#endif /* HEADER_FIXES_HPP */
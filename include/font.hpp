@@ -0,0 +1,36 @@
+#ifndef HEADER_FONT_HPP
+#define HEADER_FONT_HPP
+
+#include <set>
+#include <string>
+#include <string_view>
+
+// Add codepoints of UTF-8 text, CSS escapes ("\2192") included. Letters are
+// added in both cases because of text-transform.
+void add_codepoints(std::set<char32_t>& codepoints, std::string_view text);
+
+// Codepoints readers may render without them being in text: printable
+// ASCII, hyphens, list markers, quotes
+std::set<char32_t> default_codepoints();
+
+// Subset of TrueType font: outlines of glyphs mapped only from codepoints not
+// in set are removed. Glyph ids stay the same, so layout tables remain valid,
+// and glyphs reachable by substitution or as components are kept.
+// Returns empty string if font isn't smaller or has outlines or tables
+// this can't handle (CFF, WOFF, variations, color glyphs, AAT).
+std::string subset_font(std::string_view font, std::set<char32_t> const& codepoints);
+
+// Keys of font obfuscation from unique identifier of book, see OCF
+// specification (IDPF) and Adobe ADEPT. Adobe key is empty if identifier
+// isn't UUID.
+std::string idpf_font_key(std::string_view identifier);
+std::string adobe_font_key(std::string_view identifier);
+
+// XOR of first bytes of font with key. Same call reverts it.
+void obfuscate_font(std::string& font, std::string_view key, size_t length);
+
+// Number of obfuscated bytes
+constexpr size_t idpf_obfuscated = 1040;
+constexpr size_t adobe_obfuscated = 1024;
+
+#endif /* HEADER_FONT_HPP */
@@ -0,0 +1,21 @@
+#ifndef HEADER_JPEG_HPP
+#define HEADER_JPEG_HPP
+
+#include <string>
+#include <string_view>
+
+#include "utils.hpp"
+
+// Lossless optimization of JPEG image. DCT coefficients are copied as they
+// are and written with optimal Huffman tables, with progressive true also
+// as progressive JPEG if that is smaller. Result is verified to decode to
+// same coefficients as original.
+// Returns empty string if image is not smaller or can't be read.
+//
+// Markers kept for strip policy:
+//   None - all markers
+//   Safe - ICC profile, Adobe marker and Exif with orientation other than normal
+//   All  - Adobe marker (needed to decode colors of some images)
+std::string optimize_jpeg(std::string_view jpeg, bool progressive, ImageStrip strip);
+
+#endif /* HEADER_JPEG_HPP */
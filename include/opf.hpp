@@ -0,0 +1,14 @@
+#ifndef HEADER_OPF_HPP
+#define HEADER_OPF_HPP
+
+#include <string>
+#include <string_view>
+
+// Package document with <meta> of calibre:series and calibre:series_index
+// moved to end of <metadata> and attributes name and content of every
+// <meta> written first. Only bytes of <metadata> are scanned and changed,
+// rest of document is copied as it is without parsing.
+// Returns empty string if nothing changes or metadata can't be found.
+std::string fix_series_metadata(std::string_view opf);
+
+#endif /* HEADER_OPF_HPP */
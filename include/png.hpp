@@ -0,0 +1,21 @@
+#ifndef HEADER_PNG_HPP
+#define HEADER_PNG_HPP
+
+#include <string>
+#include <string_view>
+
+#include "utils.hpp"
+
+// Lossless recompression of PNG image. Image data is inflated, refiltered
+// with several strategies and best of them is compressed again. Result is
+// verified to decode to same pixels as original.
+// Returns empty string if image is not smaller, not supported (APNG,
+// unknown critical chunks) or malformed.
+//
+// Chunks kept for strip policy:
+//   None - all chunks
+//   Safe - critical and those affecting how pixels look (tRNS, gAMA, cHRM, sRGB, iCCP, sBIT, cICP)
+//   All  - critical and tRNS
+std::string optimize_png(std::string_view png, CompressOptions const& options, ImageStrip strip);
+
+#endif /* HEADER_PNG_HPP */
@@ -0,0 +1,39 @@
+#ifndef HEADER_PROVENANCE_HPP
+#define HEADER_PROVENANCE_HPP
+
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "zip.hpp"
+
+// Markers left in archives written by epub-repack, so later runs with same
+// settings can skip them by looking only at central directory.
+//
+// Book marker is last line of EOCD comment:
+//   "epub-repack VERSION SETTINGS ENTRIES"
+// where SETTINGS is hash of settings and ENTRIES hash of name, method, crc
+// and sizes of all entries. Entry marker is extra field of central
+// directory header (id 0x7265, "er") with hash of settings of entry and
+// its compressed size, so entry rewritten by other tool doesn't match.
+
+// 32-bit hash of settings and version of tool
+uint32_t provenance_hash(std::string_view settings);
+
+// Extra field of entry with its marker replaced by new one
+std::string provenance_extra(std::string_view extra, uint32_t settings, uint32_t compressed_size);
+
+// Extra field of entry without marker
+std::string provenance_strip(std::string_view extra);
+
+// Entry was written with given settings and wasn't changed since
+bool provenance_entry(File const& file, uint32_t settings);
+
+// EOCD comment with book marker replacing old one, other text is kept
+std::string provenance_comment(std::string_view comment, std::string_view settings, std::vector<File> const& files);
+
+// Book was written with given settings and wasn't changed since
+bool provenance_book(Zip const& zip, std::string_view settings);
+
+#endif /* HEADER_PROVENANCE_HPP */
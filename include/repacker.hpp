@@ -0,0 +1,42 @@
+#ifndef HEADER_REPACKER_HPP
+#define HEADER_REPACKER_HPP
+
+#include <functional>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+class App;
+class ThreadPool;
+
+// Repacking of books held in memory, epub-repack used as library. Settings
+// are options of command line tool, files aren't touched. Nothing is
+// printed unless -v is given, log messages then go to stderr.
+//
+// Repacker works on one book at a time, books can be repacked in parallel
+// by several repackers sharing one pool.
+class Repacker {
+public:
+	// Entries of book done and their total, called from threads of pool
+	using Progress = std::function<void(size_t done, size_t total)>;
+
+	// Options without files, e.g. {"--profile", "max", "--minify"}.
+	// Entries are compressed on pool, it has to outlive repacker. Thread
+	// calling repack() works for pool too, so ThreadPool(4) runs 4 tasks.
+	// Throws std::runtime_error on invalid option.
+	Repacker(std::vector<std::string> const& options, ThreadPool& pool);
+	~Repacker();
+
+	Repacker(Repacker const&) = delete;
+	Repacker& operator=(Repacker const&) = delete;
+
+	// Repacked archive of book. Throws std::runtime_error if epub can't be
+	// read.
+	std::string repack(std::string_view epub, Progress const& progress = {});
+
+private:
+	std::unique_ptr<App> app_;
+};
+
+#endif /* HEADER_REPACKER_HPP */
@@ -0,0 +1,94 @@
+#ifndef HEADER_THREAD_POOL_HPP
+#define HEADER_THREAD_POOL_HPP
+
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Work-stealing pool scheduling heaviest tasks first (LPT).
+//
+// Every worker owns a queue sorted by task weight. Worker always takes
+// heaviest task from its own queue and when it runs dry it steals
+// heaviest task from the other queues, so long running tasks are started
+// as early as possible and do not end up as a tail of a batch.
+class ThreadPool {
+public:
+	using Task = std::function<void()>;
+
+	// Thread waiting for tasks executes them too (see TaskGroup::wait), so
+	// threads - 1 workers are started and at most threads tasks run at once.
+	// With threads <= 1 tasks are executed only by waiting thread.
+	explicit ThreadPool(unsigned threads);
+	~ThreadPool();
+
+	ThreadPool(ThreadPool const&) = delete;
+	ThreadPool& operator=(ThreadPool const&) = delete;
+
+	// Number of tasks that can run at once
+	unsigned size() const { return static_cast<unsigned>(workers_.size() + 1); }
+
+	// Weight is expected cost of task (e.g. input size).
+	void submit(Task task, uint64_t weight = 0);
+
+	// Execute heaviest queued task on calling thread.
+	// Returns false if there was nothing to do.
+	bool run_pending();
+
+private:
+	struct Job {
+		Task task;
+		uint64_t weight;
+	};
+
+	struct Queue {
+		std::mutex mutex;
+		std::deque<Job> jobs;  // sorted by weight, heaviest first
+		uint64_t load = 0;     // sum of weights
+	};
+
+	std::vector<std::thread> workers_;
+	std::vector<std::unique_ptr<Queue>> queues_;
+
+	std::mutex mutex_;
+	std::condition_variable cv_;
+	size_t queued_ = 0;
+	bool stop_ = false;
+
+	bool pop(size_t index, Job& job);
+	bool steal(Job& job);
+	bool take(Job& job);
+	void worker(size_t index);
+};
+
+// Set of tasks submitted to pool that can be waited for together.
+class TaskGroup {
+public:
+	explicit TaskGroup(ThreadPool& pool);
+	~TaskGroup();
+
+	TaskGroup(TaskGroup const&) = delete;
+	TaskGroup& operator=(TaskGroup const&) = delete;
+
+	void run(ThreadPool::Task task, uint64_t weight = 0);
+
+	// Wait for all tasks, helping with queued work in the meantime.
+	// Rethrows first exception thrown by any of tasks.
+	void wait();
+
+private:
+	ThreadPool& pool_;
+	std::mutex mutex_;
+	std::condition_variable cv_;
+	size_t pending_ = 0;
+	std::exception_ptr error_;
+
+	void join();
+};
+
+#endif /* HEADER_THREAD_POOL_HPP */
@@ -3,20 +3,106 @@
 
 #include <fstream>
 #include <string>
+#include <string_view>
 #include <cstdint>
 
+#include "thread_pool.hpp"
+
 std::string read_file(std::string const& path);
 void write_file(std::string const& path, std::string const& str);
 
+// Read-only memory mapping of whole file
+class MappedFile {
+public:
+	explicit MappedFile(std::string const& path);
+	// Whole input of descriptor, e.g. standard input. Regular file is
+	// mapped, pipe is read into memory.
+	explicit MappedFile(int fd);
+	~MappedFile();
+
+	MappedFile(MappedFile const&) = delete;
+	MappedFile& operator=(MappedFile const&) = delete;
+
+	std::string_view data() const { return {data_, size_}; }
+
+private:
+	const char* data_ = nullptr;
+	size_t size_ = 0;
+	bool mapped_ = false;
+	std::string buffer_;
+
+	void read_all(int fd);
+};
+
+
+uint32_t read4(std::string_view str, size_t offset);
+uint16_t read2(std::string_view str, size_t offset);
+
+// Deflate backend
+enum class Method {
+	Zopfli,
+	Libdeflate,
+	Store,
+};
+
+// Compression settings of entry
+struct CompressOptions {
+	Method method = Method::Zopfli;
+	int level = 12;  // libdeflate level 1-12
+
+	// Zopfli settings
+	int iterations = 16;
+	int block_splitting_max = 15;  // 0 is unlimited
 
-uint32_t read4(std::string const& str, size_t offset);
-void write4(std::ofstream& ofs, uint32_t value);
-uint16_t read2(std::string const& str, size_t offset);
-void write2(std::ofstream& ofs, uint16_t value);
+	// Adaptive mode, see compress_adaptive()
+	int min_gain = 0;         // bytes per iteration, 0 disables
+	double time_limit = 0.0;  // seconds per entry, 0 is unlimited
 
-std::string compress(std::string_view str);
+	// Race mode: zopfli runs only if expected to save at least race_gain
+	// bytes over libdeflate level 12 and original stream; 0 disables
+	int race_gain = 0;
+};
+
+// Which optional metadata is dropped by image optimizers
+enum class ImageStrip {
+	None,  // keep everything
+	Safe,  // drop metadata not affecting how image looks
+	All,   // drop everything not needed to decode image
+};
+
+// Name of backend for messages
+std::string_view method_name(Method method);
+
+// Compress with backend selected by options. Store gives deflate stream of
+// stored blocks, entries to be stored are better written with zip method 0.
+std::string compress(std::string_view str, CompressOptions const& options);
+
+// libdeflate with level 0-12 (0 gives stored blocks), much faster than
+// zopfli, but output is bigger
+std::string compress_libdeflate(std::string_view str, int level);
+
+// Compress with 5, 10, 20, ... iterations up to options.iterations, stops
+// when last stage saved less than options.min_gain bytes per additional
+// iteration or next stage would not fit into options.time_limit.
+// Smallest result is returned, iterations run by all stages are stored to *iterations.
+std::string compress_adaptive(std::string_view str, CompressOptions const& options, int* iterations = nullptr);
+
+// Identifies compress() settings, output differs only when id differs.
+std::string compress_id(CompressOptions const& options);
+
+// Split input with zopfli block splitter and compress parts in parallel.
+// Result is single deflate stream, usually slightly bigger than compress().
+std::string compress_split(std::string_view str, CompressOptions const& options, ThreadPool& pool, size_t* parts = nullptr);
+
+// MIME type guessed from extension of file name, "application/octet-stream" if unknown
+std::string_view mime_type(std::string_view file_name);
 
 uint32_t crc32(const std::string_view str);
 
+// Raw 20 bytes of SHA-1 digest
+std::string sha1(std::string_view str);
+
+std::string to_hex(std::string_view str);
+
 #endif /* HEADER_UTILS_HPP */
 
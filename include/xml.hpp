@@ -2,19 +2,52 @@
 #define HEADER_XML_HPP
 
 #include <pugixml.hpp>
+#include <map>
+#include <set>
 #include <string>
+#include <string_view>
+#include <vector>
 
 class XML {
 public:
-	XML(std::string_view const& xml);
+	XML(std::string_view const& xml, unsigned int options = pugi::parse_default);
 
 	std::string to_string();
 
 	// from META-INF/container.xml
 	std::string get_rootfile();
 
-	// for rootfile
-	std::string fix_metadata();
+	// for rootfile: dc:identifier values, unique identifier of book first
+	std::vector<std::string> get_identifiers();
+
+	// from META-INF/encryption.xml: encrypted entry to URI of algorithm
+	std::map<std::string, std::string> get_encryption();
+
+	// Text and attribute values, as UTF-8
+	std::string text();
+
+	// Parse options of document written back by to_raw_string(), text is
+	// kept as it is
+	static constexpr unsigned int raw_options = pugi::parse_cdata | pugi::parse_pi | pugi::parse_comments |
+		pugi::parse_declaration | pugi::parse_doctype | pugi::parse_ws_pcdata | pugi::parse_eol;
+
+	// Document without formatting or escaping, empty if it can't be written
+	// back as it was read
+	std::string to_raw_string(bool xhtml);
+
+	// Document without comments and insignificant whitespace, see
+	// to_raw_string(). XHTML text is collapsed and whitespace between blocks
+	// dropped only with collapse_spaces, CSS can change both.
+	std::string minify(bool xhtml, bool collapse_spaces);
+
+	// Point references of document at path to other entries, targets maps
+	// copy to kept entry (paths in zip). Returns number of rewritten
+	// references to every copy.
+	std::map<std::string, size_t> rewrite_references(std::string_view path, std::map<std::string, std::string> const& targets);
+
+	// for rootfile at path: remove manifest items of copies that aren't in
+	// spine and point references to them at kept entries, returns their paths
+	std::set<std::string> remove_manifest_copies(std::string_view path, std::map<std::string, std::string> const& targets);
 
 private:
 	pugi::xml_document doc;
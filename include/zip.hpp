@@ -1,10 +1,13 @@
 #ifndef HEADER_ZIP_HPP
 #define HEADER_ZIP_HPP
 
+#include <memory>
 #include <string>
 #include <vector>
 #include <cstdint>
 
+#include "utils.hpp"
+
 struct LFH {
 	/*  0 */ uint32_t signature;  // 0x04034b50
 	/*  4 */ uint16_t version;
@@ -20,12 +23,12 @@ struct LFH {
 	/* 30 */
 	// filename
 	// extra field
-	std::string file_name;
+	std::string_view file_name;
 	std::string_view extra_field;
 	std::string_view data;
 
 	LFH() = default;
-	LFH(std::string const& str, size_t offset);
+	LFH(std::string_view str, size_t offset);
 	void print();
 };
 
@@ -54,12 +57,12 @@ struct CDFH {
 	// filename
 	// extra field
 	// file comment
-	std::string file_name;
+	std::string_view file_name;
 	std::string_view extra_field;
 	std::string_view file_comment;
 
 	CDFH() = default;
-	CDFH(std::string const& str, size_t offset);
+	CDFH(std::string_view str, size_t offset);
 	void print();
 };
 
@@ -77,24 +80,106 @@ struct EOCD {
 	std::string_view comment;
 
 	EOCD() = default;
-	EOCD(std::string const& str, size_t offset);
+	EOCD(std::string_view str, size_t offset);
 	void print();
 };
 
 struct File {
 	CDFH cdfh;
 	LFH lfh;
+	// Decompressed or modified data, see load()
 	std::string content;
+	bool loaded = false;
+	// content differs from lfh.data
+	bool modified = false;
+
+	// Uncompressed data. Stored entries point directly into archive,
+	// deflated ones are decompressed into content on first use.
+	std::string_view load();
+	// Free decompressed data unless it was modified
+	void unload();
+	// Replace content, updates size and crc in lfh
+	void set_content(std::string str);
 };
 
 struct Zip {
-	std::string content;
+	std::unique_ptr<MappedFile> mapping;
+	std::string_view content;
 	EOCD eocd;
 	std::vector<File> files;
 
 	Zip(std::string const& path);
+	// Archive in memory owned by caller, name is used in errors
+	Zip(std::string_view data, std::string const& name);
+	// Archive read by MappedFile, e.g. from standard input
+	Zip(std::unique_ptr<MappedFile> file, std::string const& name);
 
 	File* find_file(std::string const& fname);
+
+private:
+	void read(std::string const& name);
+};
+
+// Writes zip archive. Records are serialized into one buffer and written
+// together with entry data in large (vectored) writes.
+class ZipWriter {
+public:
+	explicit ZipWriter(std::string const& path);
+	// Archive is appended to output instead of file
+	explicit ZipWriter(std::string* output);
+	// Archive is written to descriptor owned by caller (standard output),
+	// it's never seeked so pipe works too
+	ZipWriter(int fd, std::string const& name);
+	~ZipWriter();
+
+	ZipWriter(ZipWriter const&) = delete;
+	ZipWriter& operator=(ZipWriter const&) = delete;
+
+	// Size of archive computed from entries before writing them
+	static uint64_t archive_size(std::vector<File> const& files,
+		std::vector<std::string_view> const& data,
+		EOCD const& eocd);
+
+	// Reserve disk space (or memory) for archive up front. It's only a hint.
+	void preallocate(uint64_t size);
+
+	// Append local file header and data of entry.
+	// file.lfh has to describe data, both have to live until finish().
+	void add(File const& file, std::string_view data);
+
+	// Write central directory, end of central directory record and close file.
+	void finish(EOCD const& eocd);
+
+	// Write whole archive as it is instead of entries, e.g. unchanged book.
+	void copy(std::string_view archive);
+
+	uint64_t size() const { return pos_; }
+
+private:
+	// Range of buffer_ with records or entry data
+	struct Segment {
+		size_t begin;
+		size_t end;
+		std::string_view data;
+	};
+
+	int fd_ = -1;
+	bool own_fd_ = true;
+	std::string path_;
+	std::string* output_ = nullptr;
+	std::string buffer_;
+	std::vector<Segment> segments_;
+	size_t pending_ = 0;
+	uint64_t pos_ = 0;
+	uint64_t reserved_ = 0;
+	std::vector<std::pair<File const*, uint32_t>> entries_;
+
+	void put2(uint16_t value);
+	void put4(uint32_t value);
+	void put(std::string_view str);
+	void put_data(std::string_view data);
+	void flush();
+	void write_segments();
 };
 
 #endif /* HEADER_ZIP_HPP */
@@ -5,6 +5,9 @@
 #include <fmt/color.h>
 #include <cxxopts.hpp>
 
+#include <algorithm>
+#include <thread>
+
 #ifdef _WIN32
 #include <io.h>
 
@@ -33,8 +36,8 @@ unsigned version_number() {
 
 // clang-format on
 
-static bool use_color() {
-	return isatty(fileno(stdout));
+static bool use_color(std::FILE* stream) {
+	return isatty(fileno(stream));
 }
 
 static std::string str_tolower(std::string str) {
@@ -75,6 +78,55 @@ static bool opt_is_num(std::string const& value) {
 	return value.find_first_not_of("0123456789") == std::string::npos;
 }
 
+static bool profile_options(std::string const& name, CompressOptions& options) {
+	if(name == "quick") {
+		options.method = Method::Libdeflate;
+		options.level = 12;
+		return true;
+	}
+
+	options.method = Method::Zopfli;
+	if(name == "fast") {
+		options.iterations = 5;
+		options.block_splitting_max = 15;
+	} else if(name == "balanced") {
+		options.iterations = 16;
+		options.block_splitting_max = 15;
+	} else if(name == "max") {
+		options.iterations = 60;
+		options.block_splitting_max = 0;
+	} else {
+		return false;
+	}
+	return true;
+}
+
+// MIME types matched by type given on command line
+static std::vector<std::string> mime_patterns(std::string const& type) {
+	if(type.find('/') != std::string::npos) {
+		return {type};
+	}
+	if(type == "media") {
+		// Already compressed formats, deflate gains almost nothing
+		// clang-format off
+		return {
+			"image/jpeg", "image/png", "image/gif", "image/webp",
+			"audio/*", "video/*",
+			"font/woff", "font/woff2"
+		};
+		// clang-format on
+	}
+	if(type == "image" || type == "audio" || type == "video" || type == "font" || type == "text") {
+		return {type + "/*"};
+	}
+
+	std::string_view mime = mime_type("." + type);
+	if(mime == "application/octet-stream") {
+		return {};
+	}
+	return {std::string(mime)};
+}
+
 static constexpr std::underlying_type<App::Fix>::type fix2num(App::Fix fix) noexcept {
 	return static_cast<std::underlying_type<App::Fix>::type>(fix);
 }
@@ -85,25 +137,116 @@ int App::args(int argc, char** argv) {
 	std::string repack_spec = "yes";
 	std::string color_spec = "auto";
 	std::vector<std::string> fix_spec;
+	std::vector<std::string> compress_spec;
+	std::string png_spec = "no";
+	std::string jpeg_spec = "no";
 	bool help = false;
 	bool version = false;
 
+	std::string fix_help =
+		"Apply fixes:\n"
+		"  all      - apply all fixes\n"
+		"  none     - do not apply fixes";
+	for(auto const& fixer : fixers()) {
+		fix_help += fmt::format("\n  {:<8} - {}", fixer.name, fixer.description);
+	}
+
 	try {
 		options.positional_help("FILE...");
 		options.set_width(120);
 
 		// clang-format off
 		options.add_options()
-			("f,fix",
-				"Apply fixes:\n"
-				"  all      - apply all fixes\n"
-				"  none     - do not apply fixes\n"
-				"  series   - fix series information for PocketBook",
-				cxxopts::value<std::vector<std::string>>(fix_spec), "NAME,...")
+			("f,fix", fix_help, cxxopts::value<std::vector<std::string>>(fix_spec), "NAME,...")
 			("r,repack", "Repack file; with integer value N it's alias for: -r yes -i N",
 				cxxopts::value<std::string>(repack_spec)->default_value("yes"), "yes|no|N")
-			("i,iterations", "Number of iteration",
-				cxxopts::value<int>(iterations_)->default_value("16"), "N")
+			("p,profile",
+				"Compression profile:\n"
+				"  quick    - libdeflate level 12, no zopfli\n"
+				"  fast     - 5 iterations\n"
+				"  balanced - 16 iterations\n"
+				"  max      - 60 iterations, unlimited block splitting",
+				cxxopts::value<std::string>(profile_)->default_value("balanced"), "NAME")
+			("i,iterations", "Number of iteration, overrides profile",
+				cxxopts::value<int>(iterations_), "N")
+			("adaptive",
+				"Run iterations in doubling stages up to limit set by profile or -i and stop when\n"
+				"stage gains less than N bytes per iteration; 0 disables. Stages start over, so\n"
+				"without early stop they cost up to twice the limit",
+				cxxopts::value<int>(compress_options_.min_gain)->default_value("0"), "N")
+			("entry-time", "Time limit of adaptive compression of one entry in seconds; 0 is unlimited",
+				cxxopts::value<double>(compress_options_.time_limit)->default_value("0"), "SEC")
+			("race",
+				"Compress with libdeflate first and run zopfli only if it's expected\n"
+				"to save at least N more bytes; 0 disables",
+				cxxopts::value<int>(compress_options_.race_gain)->default_value("0"), "N")
+			("compress",
+				"Compression of entries by MIME type, last match wins:\n"
+				"  TYPE - MIME type (image/jpeg), group (image/*), extension (css)\n"
+				"         or media for already compressed images, audio, video and fonts\n"
+				"  SPEC - number of iterations, profile name, libdeflate-LEVEL or store\n"
+				"  e.g. xhtml=60,css=15,media=store",
+				cxxopts::value<std::vector<std::string>>(compress_spec), "TYPE=SPEC,...")
+			("j,jobs",
+				"Number of entries compressed in parallel, thread writing books is one of them;\n"
+				"0 uses all CPU cores",
+				cxxopts::value<int>(jobs_)->default_value("1"), "N")
+			("split",
+				"Compress entries of at least N KiB as independent blocks in parallel.\n"
+				"Faster with many jobs, but output is slightly bigger; 0 disables",
+				cxxopts::value<int>(split_size_)->default_value("0"), "N")
+			("in-flight",
+				"Number of books processed at once. With N > 1 reading next books\n"
+				"and writing previous ones overlaps with compression",
+				cxxopts::value<int>(in_flight_)->default_value("1"), "N")
+			("png",
+				"Losslessly recompress PNG images:\n"
+				"  no   - leave images as they are\n"
+				"  keep - keep all chunks\n"
+				"  safe - drop metadata, keep chunks affecting colors\n"
+				"  all  - drop all optional chunks except transparency",
+				cxxopts::value<std::string>(png_spec)->default_value("no"), "no|keep|safe|all")
+			("jpeg",
+				"Losslessly optimize Huffman tables of JPEG images:\n"
+				"  no   - leave images as they are\n"
+				"  keep - keep all markers\n"
+				"  safe - drop metadata, keep color profile and Exif with rotation\n"
+				"  all  - drop all markers not needed to decode image",
+				cxxopts::value<std::string>(jpeg_spec)->default_value("no"), "no|keep|safe|all")
+			("jpeg-progressive", "Also try progressive encoding of JPEG images, kept only if smaller",
+				cxxopts::value<bool>(jpeg_progressive_)->default_value("false"))
+			("minify",
+				"Remove comments and insignificant whitespace from XHTML, OPF, NCX and CSS\n"
+				"before compression. Whitespace of text is collapsed only if no CSS can show it",
+				cxxopts::value<bool>(minify_)->default_value("false"))
+			("dedupe",
+				"Keep one copy of byte-identical images, fonts, media and CSS: references in\n"
+				"XHTML and OPF are rewritten and other copies removed. Identical entries are\n"
+				"compressed only once also without this",
+				cxxopts::value<bool>(dedupe_)->default_value("false"))
+			("fonts",
+				"Remove outlines of glyphs not used by text of book from TrueType fonts,\n"
+				"obfuscated ones included. Glyph ids stay same, other fonts are left as they are",
+				cxxopts::value<bool>(fonts_)->default_value("false"))
+			("force", "Repack also books and entries marked as already repacked with same settings",
+				cxxopts::value<bool>(force_)->default_value("false"))
+			("estimate",
+				"Print JSON with expected savings and CPU time of books instead of repacking.\n"
+				"Entries are compressed with libdeflate level 12 and result is extrapolated,\n"
+				"log messages go to standard error",
+				cxxopts::value<bool>(estimate_)->default_value("false"))
+			("sample", "Percent of entries really compressed by --estimate to calibrate it",
+				cxxopts::value<int>(sample_)->default_value("0"), "N")
+			("time-budget",
+				"Time limit of compression of one book in seconds from start of its first entry.\n"
+				"Entries with best expected gain go first, rest is compressed by libdeflate; 0 is unlimited",
+				cxxopts::value<double>(time_budget_)->default_value("0"), "SEC")
+			("total-time-budget", "Time limit of compression of all books in seconds; 0 is unlimited",
+				cxxopts::value<double>(total_time_budget_)->default_value("0"), "SEC")
+			("cache", "Directory of persistent cache of compressed entries, can be shared by processes",
+				cxxopts::value<std::string>(cache_dir_), "DIR")
+			("cache-size", "Size limit of cache in MiB, least recently used entries are removed",
+				cxxopts::value<int>(cache_size_)->default_value("1024"), "N")
 			("o,output",
 				"Output patern. Path with placeholder for output.\n"
 				"If pattern ends with '/' or output is directory then appends {FILENAME}\n"
@@ -129,20 +272,40 @@ int App::args(int argc, char** argv) {
 
 		auto result = options.parse(argc, argv);
 
-		help = result["help"].as<bool>() || (argc < 2);
+		help = result["help"].as<bool>() || (argc < 2 && !library_);
 		version = result["version"].as<bool>();
+		// Library doesn't print anything, see include/repacker.hpp
+		if(library_ && (help || version)) {
+			throw std::runtime_error("Options --help and --version can't be used here");
+		}
 
-		log_level_ = std::min(int(result.count("verbose") + 1), 3);
+		// Library is silent unless asked, see include/repacker.hpp
+		log_level_ = std::min(int(result.count("verbose") + (library_ ? 0 : 1)), 3);
 		if(result.count("silent") > 0) {
 			log_level_ = 0;
 		}
 
+		// Archive read from standard input is written to standard output and
+		// report of --estimate too, log messages mustn't get into them nor
+		// into output of program using library
+		bool standard_io = std::find(files_.begin(), files_.end(), "-") != files_.end();
+		if(standard_io || estimate_ || library_) {
+			log_ = stderr;
+		}
+
 		if(color_spec == "auto") {
-			color_ = use_color();
+			color_ = use_color(log_);
 		} else if(result.count("color")) {
 			color_ = opt_is_true(color_spec);
 		}
 
+		if(!profile_options(profile_, compress_options_)) {
+			throw std::runtime_error(fmt::format("Unknown profile: {}", profile_));
+		}
+		if(result.count("iterations") == 0) {
+			iterations_ = compress_options_.iterations;
+		}
+
 		// set repack and maybe also iterations
 		if(result.count("repack")) {
 			repack_spec = result["repack"].as<std::string>();
@@ -150,7 +313,7 @@ int App::args(int argc, char** argv) {
 			if(opt_is_num(repack_spec)) {
 				int n = std::stoi(repack_spec);
 				repack_ = true;
-				if(result.count("terations") == 0) {
+				if(result.count("iterations") == 0) {
 					iterations_ = n;
 				}
 			} else {
@@ -158,6 +321,104 @@ int App::args(int argc, char** argv) {
 			}
 		}
 
+		if(iterations_ < 1) {
+			throw std::runtime_error(fmt::format("Invalid number of iterations: {}", iterations_));
+		}
+		compress_options_.iterations = iterations_;
+
+		if(compress_options_.race_gain < 0) {
+			throw std::runtime_error(fmt::format("Invalid race gain: {}", compress_options_.race_gain));
+		}
+		if(compress_options_.min_gain < 0) {
+			throw std::runtime_error(fmt::format("Invalid adaptive gain: {}", compress_options_.min_gain));
+		}
+		if(compress_options_.time_limit < 0) {
+			throw std::runtime_error(fmt::format("Invalid entry time: {}", compress_options_.time_limit));
+		}
+
+		for(auto const& spec : compress_spec) {
+			auto eq = spec.find('=');
+			if(eq == std::string::npos) {
+				throw std::runtime_error(fmt::format("Invalid compression override: {}", spec));
+			}
+			std::string type = str_tolower(spec.substr(0, eq));
+			std::string value = str_tolower(spec.substr(eq + 1));
+
+			CompressOptions options = compress_options_;
+			std::string_view libdeflate = "libdeflate-";
+			if(!value.empty() && opt_is_num(value)) {
+				options.method = Method::Zopfli;
+				options.iterations = std::stoi(value);
+			} else if(value == "store") {
+				options.method = Method::Store;
+			} else if(value.compare(0, libdeflate.size(), libdeflate) == 0 && value.size() > libdeflate.size() && opt_is_num(value.substr(libdeflate.size()))) {
+				options.method = Method::Libdeflate;
+				options.level = std::stoi(value.substr(libdeflate.size()));
+				if(options.level < 1 || options.level > 12) {
+					throw std::runtime_error(fmt::format("Invalid libdeflate level: {}", options.level));
+				}
+			} else if(!profile_options(value, options)) {
+				throw std::runtime_error(fmt::format("Invalid compression of {}: {}", type, value));
+			}
+			if(options.iterations < 1) {
+				throw std::runtime_error(fmt::format("Invalid number of iterations: {}", options.iterations));
+			}
+
+			auto patterns = mime_patterns(type);
+			if(patterns.empty()) {
+				throw std::runtime_error(fmt::format("Unknown type: {}", type));
+			}
+			for(auto const& pattern : patterns) {
+				overrides_.emplace_back(pattern, options);
+			}
+		}
+
+		if(jobs_ < 0) {
+			throw std::runtime_error(fmt::format("Invalid number of jobs: {}", jobs_));
+		}
+		if(jobs_ == 0) {
+			jobs_ = std::max(int(std::thread::hardware_concurrency()), 1);
+		}
+		if(in_flight_ < 1) {
+			throw std::runtime_error(fmt::format("Invalid number of books in flight: {}", in_flight_));
+		}
+		png_ = png_spec != "no";
+		if(png_spec == "keep") {
+			png_strip_ = ImageStrip::None;
+		} else if(png_spec == "safe" || png_spec == "no") {
+			png_strip_ = ImageStrip::Safe;
+		} else if(png_spec == "all") {
+			png_strip_ = ImageStrip::All;
+		} else {
+			throw std::runtime_error(fmt::format("Invalid PNG policy: {}", png_spec));
+		}
+		jpeg_ = jpeg_spec != "no";
+		if(jpeg_spec == "keep") {
+			jpeg_strip_ = ImageStrip::None;
+		} else if(jpeg_spec == "safe" || jpeg_spec == "no") {
+			jpeg_strip_ = ImageStrip::Safe;
+		} else if(jpeg_spec == "all") {
+			jpeg_strip_ = ImageStrip::All;
+		} else {
+			throw std::runtime_error(fmt::format("Invalid JPEG policy: {}", jpeg_spec));
+		}
+
+		if(sample_ < 0 || sample_ > 100) {
+			throw std::runtime_error(fmt::format("Invalid sample percent: {}", sample_));
+		}
+		if(time_budget_ < 0) {
+			throw std::runtime_error(fmt::format("Invalid time budget: {}", time_budget_));
+		}
+		if(total_time_budget_ < 0) {
+			throw std::runtime_error(fmt::format("Invalid total time budget: {}", total_time_budget_));
+		}
+		if(cache_size_ < 0) {
+			throw std::runtime_error(fmt::format("Invalid cache size: {}", cache_size_));
+		}
+		if(split_size_ < 0) {
+			throw std::runtime_error(fmt::format("Invalid split size: {}", split_size_));
+		}
+
 		if(!fix_spec.empty()) {
 			fixes_ = fix2num(Fix::None);
 
@@ -168,21 +429,40 @@ int App::args(int argc, char** argv) {
 				} else if(fix == "none") {
 					fixes_ = fix2num(Fix::None);
 					break;
-				} else if(fix == "series") {
-					fixes_ |= fix2num(Fix::Series);
-				} else {
+				}
+				auto fixer = std::find_if(fixers().begin(), fixers().end(), [&](Fixer const& f) { return f.name == fix; });
+				if(fixer == fixers().end()) {
 					throw std::runtime_error(fmt::format("Unknown fix name: {}", fix));
 				}
+				fixes_ |= fix2num(fixer->fix);
 			}
 		}
 
 		if(output_pattern_[output_pattern_.size() - 1] == '/') {
 			output_pattern_ += "{FILENAME}";
 		}
+
+		if(standard_io) {
+			if(files_.size() > 1) {
+				throw std::runtime_error("Standard input (-) can't be combined with other files");
+			}
+			if(estimate_) {
+				throw std::runtime_error("Option --estimate can't be used with standard input");
+			}
+			if(isatty(fileno(stdin))) {
+				throw std::runtime_error("Refusing to read archive from terminal");
+			}
+			if(isatty(fileno(stdout))) {
+				throw std::runtime_error("Refusing to write archive to terminal");
+			}
+		}
 	} catch(std::exception const& e) {
+		if(library_) {
+			throw std::runtime_error(e.what());
+		}
 		// clang-format off
 		//fmt::print("Error:\n  {}\n\n{}\n", e.what(), options.help());
-		fmt::print("{}\n  {}\n\n{}\n",
+		fmt::print(log_, "{}\n  {}\n\n{}\n",
 			xstyled("Error:", fg_red),
 			xstyled(e.what(), fg_red),
 			options.help()
@@ -191,7 +471,9 @@ int App::args(int argc, char** argv) {
 		return 1;
 	}
 
-	print_info();
+	if(!library_) {
+		print_info();
+	}
 
 	if(help) {
 		fmt::print("{}\n", options.help());
@@ -206,14 +488,15 @@ int App::args(int argc, char** argv) {
 		xprint(2, " - pugixml v" VERSION_PUGIXML "\n");
 		xprint(2, " - libdeflate v" VERSION_LIBDEFLATE "\n");
 		xprint(2, " - zopfli v" VERSION_ZOPFLI "\n");
+		xprint(2, " - libjpeg-turbo v" VERSION_LIBJPEG "\n");
 
 		return -1;
 	}
 
-	if(files_.empty()) {
+	if(files_.empty() && !library_) {
 		// clang-format off
 		//fmt::print("Error:\n  Missing files to work on...\n\n{}\n", options.help());
-		fmt::print("\n\n{}\n",
+		fmt::print(log_, "\n\n{}\n",
 			xstyled("Error:\n  Missing files to work on...", fg_red), 
 			options.help()
 		);
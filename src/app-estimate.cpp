@@ -0,0 +1,237 @@
+#include "app.hpp"
+
+#include "zip.hpp"
+#include "utils.hpp"
+
+#include <algorithm>
+#include <chrono>
+
+// Zopfli result relative to libdeflate level 12, used when nothing was sampled
+static constexpr double default_ratio = 0.96;
+
+static std::string json_string(std::string_view str) {
+	std::string ret = "\"";
+	for(char c : str) {
+		switch(c) {
+			case '"':
+				ret += "\\\"";
+				break;
+			case '\\':
+				ret += "\\\\";
+				break;
+			case '\n':
+				ret += "\\n";
+				break;
+			case '\t':
+				ret += "\\t";
+				break;
+			default:
+				if(static_cast<unsigned char>(c) < 0x20) {
+					ret += fmt::format("\\u{:04x}", static_cast<unsigned>(c));
+				} else {
+					ret += c;
+				}
+		}
+	}
+	ret += "\"";
+	return ret;
+}
+
+// Entries are compressed with libdeflate level 12 as proxy, sampled ones
+// also with their configured compression. Ratio of both and speed measured
+// on sample are then applied to the rest. Only compression is modelled,
+// other enabled stages are listed in report. Nothing is written.
+void App::estimate() {
+	using clock = std::chrono::steady_clock;
+
+	struct Entry {
+		bool deflated = false;  // only deflated entries are recompressed
+		bool exact = false;     // size and seconds are measured, not estimated
+		bool zopfli = false;
+		uint64_t original = 0;
+		uint64_t uncompressed = 0;
+		int iterations = 0;
+		uint64_t proxy = 0;
+		uint64_t size = 0;
+		double seconds = 0.0;
+	};
+
+	struct BookEstimate {
+		std::string file;
+		std::string error;
+		uint64_t size = 0;
+		std::vector<Entry> entries;
+	};
+
+	std::vector<BookEstimate> books(files_.size());
+
+	for(size_t b = 0; b < files_.size(); ++b) {
+		BookEstimate& book = books[b];
+		book.file = files_[b];
+
+		try {
+			Zip zip(book.file);
+			book.size = zip.content.size();
+			book.entries.resize(zip.files.size());
+
+			TaskGroup group(*pool_);
+			for(size_t i = 0; i < zip.files.size(); ++i) {
+				LFH const& lfh = zip.files[i].lfh;
+				if(lfh.compression_method != 8) {
+					continue;
+				}
+
+				// clang-format off
+				group.run([this, &zip, &book, i] {
+					File& file = zip.files[i];
+					Entry& entry = book.entries[i];
+					CompressOptions const& options = compress_options(file.lfh.file_name);
+
+					entry.deflated = true;
+					entry.original = file.lfh.compressed_size;
+					entry.uncompressed = file.lfh.uncompressed_size;
+					entry.iterations = options.iterations;
+
+					std::string_view content = file.load();
+					entry.proxy = compress_libdeflate(content, 12).size();
+
+					if(options.method == Method::Store) {
+						entry.exact = true;
+						entry.size = content.size();
+					} else if(options.method == Method::Libdeflate || file.lfh.crc32 % 100 < uint32_t(sample_)) {
+						auto t = clock::now();
+						entry.exact = true;
+						entry.zopfli = options.method == Method::Zopfli;
+						entry.size = options.min_gain > 0 && entry.zopfli
+							? compress_adaptive(content, options).size()
+							: compress(content, options).size();
+						entry.seconds = std::chrono::duration<double>(clock::now() - t).count();
+					}
+
+					file.unload();
+				}, lfh.uncompressed_size);
+				// clang-format on
+			}
+			group.wait();
+		} catch(std::exception const& e) {
+			book.error = e.what();
+			book.entries.clear();
+		}
+	}
+
+	// Calibration from sampled zopfli entries
+	uint64_t sample_size = 0;
+	uint64_t sample_proxy = 0;
+	double sample_work = 0.0;  // bytes times iterations
+	double sample_seconds = 0.0;
+	size_t sampled = 0;
+	for(auto const& book : books) {
+		for(auto const& entry : book.entries) {
+			if(entry.zopfli) {
+				sample_size += entry.size;
+				sample_proxy += entry.proxy;
+				sample_work += double(entry.uncompressed) * entry.iterations;
+				sample_seconds += entry.seconds;
+				++sampled;
+			}
+		}
+	}
+	double ratio = sample_proxy > 0 ? double(sample_size) / double(sample_proxy) : default_ratio;
+
+	auto seconds_of = [&](Entry const& entry) {
+		if(entry.exact) {
+			return entry.seconds;
+		}
+		if(sample_work > 0) {
+			return sample_seconds * double(entry.uncompressed) * entry.iterations / sample_work;
+		}
+		return zopfli_seconds(entry.uncompressed, entry.iterations);
+	};
+
+	auto saving_of = [&](Entry const& entry) {
+		auto size = entry.exact ? entry.size : static_cast<uint64_t>(double(entry.proxy) * ratio);
+		return static_cast<int64_t>(entry.original) - static_cast<int64_t>(std::min(size, entry.original));
+	};
+
+	// Enabled stages whose effect on size and time isn't estimated
+	bool race = compress_options_.race_gain > 0;
+	for(auto const& [type, options] : overrides_) {
+		race = race || options.race_gain > 0;
+	}
+	// clang-format off
+	std::pair<std::string_view, bool> const stages[] = {
+		{"race", race},
+		{"time-budget", time_budget_ > 0},
+		{"total-time-budget", total_time_budget_ > 0},
+		{"entry-time", compress_options_.time_limit > 0},
+		{"split", split_size_ > 0},
+		{"png", png_},
+		{"jpeg", jpeg_},
+		{"minify", minify_},
+		{"dedupe", dedupe_},
+		{"fonts", fonts_},
+	};
+	// clang-format on
+	std::string not_modelled;
+	for(auto const& [name, enabled] : stages) {
+		if(enabled) {
+			not_modelled += fmt::format("{}{}", not_modelled.empty() ? "" : ", ", json_string(name));
+		}
+	}
+
+	uint64_t total_size = 0;
+	int64_t total_saving = 0;
+	double total_seconds = 0.0;
+
+	// clang-format off
+	fmt::print("{{\n  \"method\": {},\n  \"sample\": {},\n  \"sampled_entries\": {},\n  \"ratio\": {:.4f},\n  \"not_modelled\": [{}],\n  \"books\": [",
+		json_string(compress_id(compress_options_)),
+		sample_,
+		sampled,
+		ratio,
+		not_modelled
+	);
+	// clang-format on
+
+	for(size_t b = 0; b < books.size(); ++b) {
+		auto const& book = books[b];
+		fmt::print("{}\n    {{\"file\": {}", b > 0 ? "," : "", json_string(book.file));
+		if(!book.error.empty()) {
+			fmt::print(", \"error\": {}}}", json_string(book.error));
+			continue;
+		}
+
+		size_t entries = 0;
+		int64_t saving = 0;
+		double seconds = 0.0;
+		for(auto const& entry : book.entries) {
+			if(entry.deflated) {
+				++entries;
+				saving += saving_of(entry);
+				seconds += seconds_of(entry);
+			}
+		}
+		total_size += book.size;
+		total_saving += saving;
+		total_seconds += seconds;
+
+		// clang-format off
+		fmt::print(", \"size\": {}, \"entries\": {}, \"saving\": {}, \"cpu_seconds\": {:.3f}}}",
+			book.size,
+			entries,
+			saving,
+			seconds
+		);
+		// clang-format on
+	}
+
+	// clang-format off
+	fmt::print("\n  ],\n  \"total\": {{\"books\": {}, \"size\": {}, \"saving\": {}, \"cpu_seconds\": {:.3f}, \"wall_seconds\": {:.3f}}}\n}}\n",
+		books.size(),
+		total_size,
+		total_saving,
+		total_seconds,
+		total_seconds / std::max(jobs_, 1)
+	);
+	// clang-format on
+}
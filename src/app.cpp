@@ -4,6 +4,27 @@
 #include "zip.hpp"
 #include "xml.hpp"
 #include "utils.hpp"
+#include "cache.hpp"
+#include "provenance.hpp"
+#include "css.hpp"
+#include "font.hpp"
+#include "opf.hpp"
+
+#include <algorithm>
+#include <cctype>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <set>
+#include <thread>
+#include <tuple>
+
+static double seconds(std::chrono::steady_clock::duration d) {
+	return std::chrono::duration<double>(d).count();
+}
 
 static void replace_all(std::string& str, std::string const& from, std::string const& to) {
 	std::string::size_type pos = 0;
@@ -13,71 +34,431 @@ static void replace_all(std::string& str, std::string const& from, std::string c
 	}
 }
 
+static std::string_view strip_name(ImageStrip strip) {
+	switch(strip) {
+		case ImageStrip::None:
+			return "keep";
+		case ImageStrip::Safe:
+			return "safe";
+		default:
+			return "all";
+	}
+}
+
+// Byte-identical content. Streams are compared first, so copies written by
+// same compressor aren't decompressed.
+static bool same_content(File& a, File& b) {
+	if(a.lfh.crc32 != b.lfh.crc32 || a.lfh.uncompressed_size != b.lfh.uncompressed_size) {
+		return false;
+	}
+	if(!a.modified && !b.modified && a.lfh.compression_method == b.lfh.compression_method && a.lfh.data == b.lfh.data) {
+		return true;
+	}
+	return a.load() == b.load();
+}
+
+// Book being processed. Compression of its entries runs on shared pool
+// between load_book() and save_zip().
+struct App::Book {
+	using clock = std::chrono::steady_clock;
+
+	std::string input;
+	std::string output;
+	Zip zip;
+
+	// Results of compression, indexed same as zip.files
+	std::vector<std::string> compressed;
+	std::vector<clock::duration> times;
+	std::vector<size_t> parts;
+	std::vector<size_t> whole_sizes;
+	std::vector<uint8_t> cached;
+	std::vector<int> iterations;  // spent by adaptive compression
+	std::vector<Method> methods;
+	std::vector<uint8_t> fallback;  // libdeflate used, zopfli wouldn't fit into time budget
+	std::vector<uint32_t> settings;  // provenance hash of entry settings
+	std::vector<uint8_t> marked;     // unchanged since previous run with same settings
+	std::vector<int64_t> image_saved;
+	std::vector<int64_t> minify_saved;
+	std::vector<size_t> same_as;     // earlier entry with same content and settings whose result is reused
+
+	// Whole book is unchanged since previous run with same settings
+	bool skip = false;
+
+	// Storage of rewritten central directory extra fields and EOCD comment
+	std::vector<std::string> extras;
+	std::string comment;
+
+	// Clock of book starts with its first entry task, so time spent queued
+	// behind entries of earlier books doesn't count into --time-budget
+	clock::time_point start;
+	std::once_flag started;
+
+	clock::time_point begin() {
+		std::call_once(started, [this] { start = clock::now(); });
+		return start;
+	}
+
+	// Archive of book in memory is written to this instead of output file
+	std::string* memory_output = nullptr;
+	// Archive is written to standard output entry by entry as they are done
+	bool stream_output = false;
+
+	Progress progress;
+	std::atomic<size_t> done{0};
+
+	// Entries whose compression is over, see wait_entry()
+	std::vector<uint8_t> finished;
+	std::mutex mutex;
+	std::condition_variable cv;
+
+	ThreadPool& pool;
+
+	// Declared last so it's joined before anything tasks refer to is destroyed.
+	TaskGroup group;
+
+	Book(std::string const& input, std::string const& output, ThreadPool& pool) :
+		input(input), output(output), zip(input), pool(pool), group(pool) {
+	}
+
+	Book(std::string_view data, std::string* memory_output, ThreadPool& pool) :
+		input("memory"), output("memory"), zip(data, input), memory_output(memory_output), pool(pool), group(pool) {
+	}
+
+	// Book read from standard input is written to standard output
+	Book(std::unique_ptr<MappedFile> data, ThreadPool& pool) :
+		input("standard input"), output("standard output"), zip(std::move(data), input), stream_output(true), pool(pool), group(pool) {
+	}
+
+	// Report entries that are done
+	void step(size_t count = 1) {
+		size_t total = zip.files.size();
+		size_t now = done += count;
+		if(progress && count > 0) {
+			progress(now, total);
+		}
+	}
+
+	void finish_entry(size_t i) {
+		{
+			std::lock_guard lock(mutex);
+			finished[i] = 1;
+		}
+		cv.notify_all();
+		step();
+	}
+
+	// Wait for single entry, helping pool meanwhile like TaskGroup::wait()
+	void wait_entry(size_t i) {
+		std::unique_lock lock(mutex);
+		while(!finished[i]) {
+			lock.unlock();
+			bool ran = pool.run_pending();
+			lock.lock();
+			if(!ran) {
+				cv.wait(lock, [&] { return finished[i] != 0; });
+			}
+		}
+	}
+};
+
 int App::run(int argc, char** argv) {
 	int ret = args(argc, argv);
 	if(ret != 0) {
 		return ret + 1;
 	}
 
-	for(auto const& file : files_) {
-		fs::path p(file);
-		std::string filename = p.filename().string();
-		std::string name = p.stem().string();
-		std::string ext = p.extension().string();
-		std::string dir = p.parent_path().string();
-		if(dir.empty()) {
-			dir = ".";
-		}
-		if(!ext.empty() && ext[0] == '.') {
-			ext = ext.substr(1);
-		}
+	run_start_ = std::chrono::steady_clock::now();
+	own_pool_ = std::make_unique<ThreadPool>(static_cast<unsigned>(jobs_));
+	pool_ = own_pool_.get();
+
+	if(estimate_) {
+		estimate();
+		return 0;
+	}
 
-		std::string output(output_pattern_);
-		replace_all(output, "{DIR}", dir);
-		replace_all(output, "{FILENAME}", filename);
-		replace_all(output, "{NAME}", name);
-		replace_all(output, "{EXT}", ext);
+	prepare();
 
-		fs::path out(output);
-		fs::path out_parent_path(out.parent_path());
-		if(!out_parent_path.empty() && !fs::exists(out_parent_path)) {
-			fs::create_directories(out_parent_path);
-		}
-		if(fs::is_directory(out)) {
-			out.append(filename);
-			output = out.string();
-		}
-		if(fs::exists(out) && !fs::is_regular_file(out)) {
-			throw std::runtime_error(fmt::format("\"{}\" exists and is not regular file", output));
+	if(files_.size() == 1 && files_[0] == "-") {
+		repack_stdin();
+	} else if(in_flight_ > 1 && files_.size() > 1) {
+		run_pipeline();
+	} else {
+		for(auto const& file : files_) {
+			auto book = load_book(file);
+			save_zip(*book);
 		}
+	}
 
-		// clang-format off
-		xprint(1, "{} => {}\n",
-			xstyled(file, fg_bright_green),
-			xstyled(output, fg_yellow)
-		);
-		// clang-format on
+	trim_cache();
+
+	return 0;
+}
+
+void App::trim_cache() {
+	if(cache_) {
+		cache_->trim();
+	}
+}
+
+// Settings recorded in markers and cache, after options are parsed
+void App::prepare() {
+	// clang-format off
+	provenance_ = fmt::format("{}|split={}|fixes={}|png={}|jpeg={}|minify={}|dedupe={}|fonts={}",
+		compress_id(compress_options_),
+		split_size_,
+		fixes_,
+		image_id("a.png"),
+		image_id("a.jpg"),
+		minify_,
+		dedupe_,
+		fonts_
+	);
+	// clang-format on
+	for(auto const& [type, options] : overrides_) {
+		provenance_ += fmt::format("|{}={}", type, compress_id(options));
+	}
+
+	if(!cache_dir_.empty()) {
+		cache_ = std::make_unique<Cache>(cache_dir_, uint64_t(cache_size_) << 20);
+	}
+}
 
-		if(!fs::exists(p)) {
-			throw std::runtime_error(fmt::format("File \"{}\" not found", file));
+void App::configure(std::vector<std::string> const& options, ThreadPool& pool) {
+	library_ = true;
+
+	std::vector<std::string> arguments{"epub-repack"};
+	arguments.insert(arguments.end(), options.begin(), options.end());
+	std::vector<char*> argv;
+	for(auto& argument : arguments) {
+		argv.push_back(argument.data());
+	}
+	// Invalid options, --help and --version throw in library mode
+	args(static_cast<int>(argv.size()), argv.data());
+	if(!files_.empty() || estimate_) {
+		throw std::runtime_error("Files and --estimate can't be used here");
+	}
+
+	run_start_ = std::chrono::steady_clock::now();
+	pool_ = &pool;
+	prepare();
+}
+
+std::string App::repack(std::string_view epub, Progress const& progress) {
+	std::string output;
+	Book book(epub, &output, *pool_);
+	book.progress = progress;
+	start_book(book);
+	save_zip(book);
+	return output;
+}
+
+// Whole input has to be read first, central directory is at its end.
+// Output is streamed by save_zip() as entries are done.
+void App::repack_stdin() {
+	// clang-format off
+	xprint(1, "{} => {}\n",
+		xstyled("standard input", fg_bright_green),
+		xstyled("standard output", fg_yellow)
+	);
+	// clang-format on
+
+	Book book(std::make_unique<MappedFile>(fileno(stdin)), *pool_);
+	start_book(book);
+	save_zip(book);
+}
+
+// Books are loaded and fixed on this thread, their entries are compressed
+// by pool and separate thread writes them in order as they are done.
+// At most in_flight_ books are kept in memory at once.
+void App::run_pipeline() {
+	std::mutex mutex;
+	std::condition_variable cv;
+	std::deque<std::unique_ptr<Book>> queue;
+	size_t in_flight = 0;
+	bool done = false;
+	std::exception_ptr error;
+
+	std::thread writer([&] {
+		for(;;) {
+			std::unique_ptr<Book> book;
+			bool failed = false;
+			{
+				std::unique_lock lock(mutex);
+				cv.wait(lock, [&] { return done || !queue.empty(); });
+				if(queue.empty()) {
+					return;
+				}
+				book = std::move(queue.front());
+				queue.pop_front();
+				failed = bool(error);
+			}
+
+			// After failure remaining books are only waited for and dropped.
+			if(!failed) {
+				try {
+					save_zip(*book);
+				} catch(...) {
+					std::lock_guard lock(mutex);
+					error = std::current_exception();
+				}
+			}
+			book.reset();
+
+			{
+				std::lock_guard lock(mutex);
+				--in_flight;
+			}
+			cv.notify_all();
 		}
-		if(!fs::is_regular_file(p)) {
-			throw std::runtime_error(fmt::format("\"{}\" is not a file", file));
+	});
+
+	std::exception_ptr load_error;
+	try {
+		for(auto const& file : files_) {
+			{
+				std::unique_lock lock(mutex);
+				cv.wait(lock, [&] { return error || in_flight < size_t(in_flight_); });
+				if(error) {
+					break;
+				}
+				++in_flight;
+			}
+
+			std::unique_ptr<Book> book;
+			try {
+				book = load_book(file);
+			} catch(...) {
+				std::lock_guard lock(mutex);
+				--in_flight;
+				throw;
+			}
+
+			{
+				std::lock_guard lock(mutex);
+				queue.push_back(std::move(book));
+			}
+			cv.notify_all();
 		}
+	} catch(...) {
+		load_error = std::current_exception();
+	}
 
-		Zip zip{file};
+	{
+		std::lock_guard lock(mutex);
+		done = true;
+	}
+	cv.notify_all();
+	writer.join();
+
+	// Failure of earlier book is reported first.
+	if(error) {
+		std::rethrow_exception(error);
+	}
+	if(load_error) {
+		std::rethrow_exception(load_error);
+	}
+}
 
-		File* container_xml = zip.find_file("META-INF/container.xml");
-		if(!container_xml) {
-			throw std::runtime_error(fmt::format("Not an epub file: \"{}\"", file));
+CompressOptions const& App::compress_options(std::string_view file_name) const {
+	std::string_view mime = mime_type(file_name);
+	for(auto it = overrides_.rbegin(); it != overrides_.rend(); ++it) {
+		std::string_view pattern = it->first;
+		bool match = pattern.size() > 2 && pattern.substr(pattern.size() - 2) == "/*"
+			? mime.substr(0, pattern.size() - 1) == pattern.substr(0, pattern.size() - 1)
+			: mime == pattern;
+		if(match) {
+			return it->second;
 		}
+	}
+	return compress_options_;
+}
 
-		fix_series(zip);
+std::string App::output_path(std::string const& file) {
+	fs::path p(file);
+	std::string filename = p.filename().string();
+	std::string name = p.stem().string();
+	std::string ext = p.extension().string();
+	std::string dir = p.parent_path().string();
+	if(dir.empty()) {
+		dir = ".";
+	}
+	if(!ext.empty() && ext[0] == '.') {
+		ext = ext.substr(1);
+	}
 
-		save_zip(zip, output);
+	std::string output(output_pattern_);
+	replace_all(output, "{DIR}", dir);
+	replace_all(output, "{FILENAME}", filename);
+	replace_all(output, "{NAME}", name);
+	replace_all(output, "{EXT}", ext);
+
+	fs::path out(output);
+	fs::path out_parent_path(out.parent_path());
+	if(!out_parent_path.empty() && !fs::exists(out_parent_path)) {
+		fs::create_directories(out_parent_path);
+	}
+	if(fs::is_directory(out)) {
+		out.append(filename);
+		output = out.string();
+	}
+	if(fs::exists(out) && !fs::is_regular_file(out)) {
+		throw std::runtime_error(fmt::format("\"{}\" exists and is not regular file", output));
 	}
 
-	return 0;
+	return output;
+}
+
+std::unique_ptr<App::Book> App::load_book(std::string const& file) {
+	std::string output = output_path(file);
+
+	// clang-format off
+	xprint(1, "{} => {}\n",
+		xstyled(file, fg_bright_green),
+		xstyled(output, fg_yellow)
+	);
+	// clang-format on
+
+	fs::path p(file);
+	if(!fs::exists(p)) {
+		throw std::runtime_error(fmt::format("File \"{}\" not found", file));
+	}
+	if(!fs::is_regular_file(p)) {
+		throw std::runtime_error(fmt::format("\"{}\" is not a file", file));
+	}
+
+	auto book = std::make_unique<Book>(file, output, *pool_);
+	start_book(*book);
+	return book;
+}
+
+// Fix book and start compression of its entries, see save_zip()
+void App::start_book(Book& book) {
+	Zip& zip = book.zip;
+
+	File* container_xml = zip.find_file("META-INF/container.xml");
+	if(!container_xml) {
+		throw std::runtime_error(fmt::format("Not an epub file: \"{}\"", book.input));
+	}
+
+	if(!force_ && provenance_book(zip, provenance_)) {
+		xprint(1, " - already repacked with same settings, skipping\n");
+		book.skip = true;
+		book.step(zip.files.size());
+		return;
+	}
+
+	Documents documents(zip);
+	fix_book(documents);
+	std::string const& rootfile = documents.rootfile();
+	xprint(2, "rootfile: {}\n", rootfile);
+	if(dedupe_ && !rootfile.empty()) {
+		dedupe_resources(zip, rootfile);
+	}
+	if(fonts_ && !rootfile.empty()) {
+		subset_fonts(zip, rootfile);
+	}
+
+	compress_zip(book);
 }
 
 constexpr std::underlying_type<App::Fix>::type fix2num(App::Fix fix) noexcept {
@@ -85,6 +466,14 @@ constexpr std::underlying_type<App::Fix>::type fix2num(App::Fix fix) noexcept {
 }
 
 void App::print_info() {
+	std::string fix_names;
+	for(auto const& fixer : fixers()) {
+		if(fixes_ & fix2num(fixer.fix)) {
+			fix_names += fix_names.empty() ? "" : ",";
+			fix_names += fixer.name;
+		}
+	}
+
 	// clang-format off
 	xprint(3,
 		"App {{\n"
@@ -92,17 +481,65 @@ void App::print_info() {
 		"  log_level: ........ {}\n"
 		"  color: ............ {}\n"
 		"  repack: ........... {}\n"
+		"  profile: .......... {}\n"
 		"  iterations: ....... {}\n"
-		"  fix_series: ....... {}\n"
+		"  block_split_max: .. {}\n"
+		"  method: ........... {}\n"
+		"  adaptive: ......... {}\n"
+		"  entry_time: ....... {}\n"
+		"  jobs: ............. {}\n"
+		"  split_size: ....... {}\n"
+		"  in_flight: ........ {}\n"
+		"  png: .............. {}\n"
+		"  jpeg: ............. {}\n"
+		"  minify: ........... {}\n"
+		"  dedupe: ........... {}\n"
+		"  fonts: ............ {}\n"
+		"  force: ............ {}\n"
+		"  estimate: ......... {}\n"
+		"  sample: ........... {}\n"
+		"  time_budget: ...... {}\n"
+		"  total_time_budget:  {}\n"
+		"  cache: ............ {}\n"
+		"  cache_size: ....... {}\n"
+		"  fixes: ............ {}\n"
 		"}}\n",
 		xstyled(output_pattern_, fg_bright_white),
 		xstyled(log_level_, fg_bright_white),
 		xstyled(color_, fg_bright_white),
 		xstyled(repack_, fg_bright_white),
+		xstyled(profile_, fg_bright_white),
 		xstyled(iterations_, fg_bright_white),
-		xstyled(bool(fixes_ & fix2num(Fix::Series)), fg_bright_white)
+		xstyled(compress_options_.block_splitting_max, fg_bright_white),
+		xstyled(compress_id(compress_options_), fg_bright_white),
+		xstyled(compress_options_.min_gain, fg_bright_white),
+		xstyled(compress_options_.time_limit, fg_bright_white),
+		xstyled(jobs_, fg_bright_white),
+		xstyled(split_size_, fg_bright_white),
+		xstyled(in_flight_, fg_bright_white),
+		xstyled(image_id("a.png"), fg_bright_white),
+		xstyled(image_id("a.jpg"), fg_bright_white),
+		xstyled(minify_, fg_bright_white),
+		xstyled(dedupe_, fg_bright_white),
+		xstyled(fonts_, fg_bright_white),
+		xstyled(force_, fg_bright_white),
+		xstyled(estimate_, fg_bright_white),
+		xstyled(sample_, fg_bright_white),
+		xstyled(time_budget_, fg_bright_white),
+		xstyled(total_time_budget_, fg_bright_white),
+		xstyled(cache_dir_, fg_bright_white),
+		xstyled(cache_size_, fg_bright_white),
+		xstyled(fix_names, fg_bright_white)
 	);
 
+	xprint(3, "Compression overrides:\n");
+	for(auto const& [type, options] : overrides_) {
+		xprint(3, "{}: {}\n",
+			xstyled(type, fg_bright_white),
+			xstyled(compress_id(options), fg_bright_white)
+		);
+	}
+
 	xprint(3, "Files:\n");
 	for(auto const& file : files_) {
 		xprint(3, "{}\n",
@@ -113,138 +550,943 @@ void App::print_info() {
 	// clang-format on
 }
 
-void App::fix_series(Zip& zip) {
-	File* file = zip.find_file("META-INF/container.xml");
-	if(file) {
-		xprint(2, "Found: {}\n", file->lfh.file_name);
-		XML xml(file->content);
-		std::string rootfile = xml.get_rootfile();
+// Enabled fixes run in batches of fixes using disjoint documents, each
+// batch in parallel on pool. Documents are parsed once for all of them.
+void App::fix_book(Documents& documents) {
+	std::vector<std::pair<Fixer const*, std::vector<std::string>>> pending;
+	for(auto const& fixer : fixers()) {
+		if(fixes_ & fix2num(fixer.fix)) {
+			auto paths = fixer.documents(documents);
+			documents.load(paths);
+			pending.emplace_back(&fixer, std::move(paths));
+		}
+	}
 
-		xprint(2, "rootfile: {}\n", rootfile);
+	while(!pending.empty()) {
+		std::set<std::string> used;
+		std::vector<std::pair<Fixer const*, std::vector<std::string>>> batch;
+		std::vector<std::pair<Fixer const*, std::vector<std::string>>> rest;
+		for(auto& fix : pending) {
+			bool disjoint = std::none_of(fix.second.begin(), fix.second.end(), [&](std::string const& path) { return used.count(path) > 0; });
+			if(disjoint) {
+				used.insert(fix.second.begin(), fix.second.end());
+				batch.push_back(std::move(fix));
+			} else {
+				rest.push_back(std::move(fix));
+			}
+		}
 
-		File* f = zip.find_file(rootfile);
-		if(f) {
-			XML x(f->content);
-			std::string v = x.fix_metadata();
+		std::vector<uint8_t> changed(batch.size(), 0);
+		TaskGroup group(*pool_);
+		for(size_t i = 0; i < batch.size(); ++i) {
+			group.run([&, i] { changed[i] = batch[i].first->apply(documents, batch[i].second); });
+		}
+		group.wait();
 
-			f->content = v;
-			f->lfh.uncompressed_size = static_cast<uint32_t>(v.size());
-			f->lfh.crc32 = crc32(v);
+		for(size_t i = 0; i < batch.size(); ++i) {
+			for(auto const& path : changed[i] ? batch[i].second : std::vector<std::string>()) {
+				xprint(2, "Fixed {}: {}\n", batch[i].first->name, path);
+			}
 		}
+		pending = std::move(rest);
 	}
+
+	documents.commit();
 }
 
-void App::save_zip(Zip& zip, std::string const& filename) {
-	std::ofstream ofs(filename.c_str(), std::ios::binary);
-	std::vector<uint32_t> offsets;
-	uint32_t pos = 0;
+// Byte-identical resources (images, fonts, media, CSS) are reduced to one
+// copy: references in XHTML and OPF are pointed at first copy and others are
+// removed. Copy that may be referenced from anywhere else is kept.
+void App::dedupe_resources(Zip& zip, std::string const& rootfile) {
+	File* opf = zip.find_file(rootfile);
+	if(!opf) {
+		return;
+	}
 
-	auto write_str = [&ofs](std::string_view const& str) {
-		// Hide warning about conversion changing signedness
-		// write() accepts parameter of type streamsize (signed)
-		// but size() return size_t (unsigned)
-		ofs.write(str.data(), static_cast<std::streamsize>(str.size()));
+	auto removable = [](std::string_view name) {
+		std::string_view type = mime_type(name);
+		bool resource = type == "text/css" || (type.substr(0, 6) == "image/" && type != "image/svg+xml") ||
+			type.substr(0, 5) == "font/" || type.substr(0, 6) == "audio/" || type.substr(0, 6) == "video/";
+		// References to other names could be escaped in ways not matched here
+		bool plain = std::all_of(name.begin(), name.end(), [](char c) {
+			return std::isalnum(static_cast<unsigned char>(c)) || c == '.' || c == '_' || c == '-' || c == '/';
+		});
+		return resource && plain && name.substr(0, 9) != "META-INF/";
 	};
 
+	std::map<std::string, std::string> targets;
+	std::map<std::pair<uint32_t, uint32_t>, std::vector<size_t>> first_copies;
 	for(size_t i = 0; i < zip.files.size(); ++i) {
-		LFH& lfh = zip.files[i].lfh;
+		File& file = zip.files[i];
+		if(!removable(file.lfh.file_name)) {
+			continue;
+		}
+		// Relative url() and @import of style sheet resolve against its own
+		// directory, so only style sheets in same directory are same
+		bool css = mime_type(file.lfh.file_name) == "text/css";
+		auto same_place = [&](size_t j) {
+			std::string_view other = zip.files[j].lfh.file_name;
+			std::string_view name = file.lfh.file_name;
+			return !css || other.substr(0, other.rfind('/') + 1) == name.substr(0, name.rfind('/') + 1);
+		};
+		auto& copies = first_copies[{file.lfh.crc32, file.lfh.uncompressed_size}];
+		auto first = std::find_if(copies.begin(), copies.end(), [&](size_t j) { return same_place(j) && same_content(zip.files[j], file); });
+		if(first != copies.end()) {
+			targets[std::string(file.lfh.file_name)] = std::string(zip.files[*first].lfh.file_name);
+			file.unload();
+		} else {
+			copies.push_back(i);
+		}
+	}
+	if(targets.empty()) {
+		return;
+	}
+
+	auto occurrences = [](std::string_view text, std::string_view word) {
+		size_t count = 0;
+		for(size_t pos = text.find(word); pos != std::string_view::npos; pos = text.find(word, pos + 1)) {
+			++count;
+		}
+		return count;
+	};
+	auto file_name = [](std::string_view path) {
+		return path.substr(path.rfind('/') + 1);
+	};
+
+	// Copy is kept if its name appears anywhere references aren't rewritten
+	std::vector<File*> documents;
+	for(File& file : zip.files) {
+		std::string_view type = mime_type(file.lfh.file_name);
+		if(&file == opf || (type.substr(0, 5) != "text/" && type.find("xml") == std::string_view::npos && type != "application/javascript")) {
+			continue;
+		}
+		std::string_view content = file.load();
+		std::map<std::string, size_t> counts;
+		if(type == "application/xhtml+xml") {
+			// References count only if document can be written back
+			try {
+				XML xml(content, XML::raw_options);
+				auto rewritten = xml.rewrite_references(file.lfh.file_name, targets);
+				if(!xml.to_raw_string(true).empty()) {
+					counts = std::move(rewritten);
+				}
+			} catch(std::exception const&) {
+			}
+			documents.push_back(&file);
+		}
+		for(auto it = targets.begin(); it != targets.end();) {
+			auto count = counts.find(it->first);
+			if(occurrences(content, file_name(it->first)) > (count != counts.end() ? count->second : 0)) {
+				it = targets.erase(it);
+			} else {
+				++it;
+			}
+		}
+	}
+
+	// Package decides which copies can go (not in spine, both in manifest),
+	// documents are rewritten only for those
+	XML package(opf->load(), XML::raw_options);
+	auto removed = package.remove_manifest_copies(rootfile, targets);
+	std::string rewritten = removed.empty() ? std::string() : package.to_raw_string(false);
+	if(rewritten.empty()) {
+		return;
+	}
+	for(auto it = targets.begin(); it != targets.end();) {
+		it = removed.count(it->first) > 0 ? std::next(it) : targets.erase(it);
+	}
+
+	for(File* file : documents) {
+		try {
+			XML xml(file->load(), XML::raw_options);
+			auto counts = xml.rewrite_references(file->lfh.file_name, targets);
+			std::string document = counts.empty() ? std::string() : xml.to_raw_string(true);
+			if(!document.empty()) {
+				file->set_content(std::move(document));
+			}
+		} catch(std::exception const&) {
+		}
+	}
+	opf->set_content(std::move(rewritten));
+
+	for(auto const& copy : removed) {
+		xprint(2, "Removed copy: {} (same as {})\n", copy, targets[copy]);
+	}
+	auto end = std::remove_if(zip.files.begin(), zip.files.end(), [&](File const& file) {
+		return removed.count(std::string(file.lfh.file_name)) > 0;
+	});
+	zip.files.erase(end, zip.files.end());
+	zip.eocd.entries_in_this_disk = static_cast<uint16_t>(zip.files.size());
+	zip.eocd.total_entries = static_cast<uint16_t>(zip.files.size());
+}
+
+// Entity reference other than predefined ones of XML, its character isn't
+// known without DTD
+static bool has_named_entity(std::string_view text) {
+	for(size_t pos = text.find('&'); pos != std::string_view::npos; pos = text.find('&', pos + 1)) {
+		size_t end = pos + 1;
+		while(end < text.size() && std::isalnum(static_cast<unsigned char>(text[end]))) {
+			++end;
+		}
+		std::string_view name = text.substr(pos + 1, end - pos - 1);
+		if(end == text.size() || text[end] != ';' || name.empty() || !std::isalpha(static_cast<unsigned char>(name[0]))) {
+			continue;
+		}
+		if(name != "amp" && name != "lt" && name != "gt" && name != "quot" && name != "apos") {
+			return true;
+		}
+	}
+	return false;
+}
+
+// Fonts keep glyphs of characters in documents and style sheets, see
+// subset_font(). Obfuscated fonts are reverted with key of book identifier
+// first. Book whose text can't be read completely (scripts, entities, broken
+// documents) is left as it is.
+void App::subset_fonts(Zip& zip, std::string const& rootfile) {
+	File* opf = zip.find_file(rootfile);
+	if(!opf) {
+		return;
+	}
+
+	std::set<char32_t> codepoints = default_codepoints();
+	std::vector<File*> fonts;
+	for(File& file : zip.files) {
+		std::string_view type = mime_type(file.lfh.file_name);
+		if(type == "font/ttf" || type == "font/otf") {
+			fonts.push_back(&file);
+		} else if(type == "text/css" || type == "text/plain") {
+			add_codepoints(codepoints, file.load());
+		} else if(type == "application/javascript") {
+			xprint(2, "Fonts not subset, text may come from script: {}\n", file.lfh.file_name);
+			return;
+		} else if(type == "application/xhtml+xml" || type == "text/html" || type == "image/svg+xml" || type == "application/x-dtbncx+xml") {
+			std::string_view content = file.load();
+			try {
+				if(has_named_entity(content)) {
+					throw std::runtime_error("named entity");
+				}
+				add_codepoints(codepoints, XML(content).text());
+			} catch(std::exception const& e) {
+				xprint(2, "Fonts not subset, text of {} can't be read: {}\n", file.lfh.file_name, e.what());
+				return;
+			}
+		}
+	}
+	if(fonts.empty()) {
+		return;
+	}
+
+	std::map<std::string, std::string> encryption;
+	if(File* file = zip.find_file("META-INF/encryption.xml")) {
+		encryption = XML(file->load()).get_encryption();
+	}
+	std::vector<std::string> identifiers = XML(opf->load()).get_identifiers();
+
+	for(File* file : fonts) {
+		std::string content(file->load());
+		std::string key;
+		size_t length = 0;
+
+		auto encrypted = encryption.find(std::string(file->lfh.file_name));
+		if(encrypted != encryption.end()) {
+			bool idpf = encrypted->second == "http://www.idpf.org/2008/embedding";
+			if(!idpf && encrypted->second != "http://ns.adobe.com/pdf/enc#RC") {
+				continue;
+			}
+			length = idpf ? idpf_obfuscated : adobe_obfuscated;
+
+			// Right key reveals header of font
+			for(auto const& identifier : identifiers) {
+				std::string candidate = idpf ? idpf_font_key(identifier) : adobe_font_key(identifier);
+				std::string header = content.substr(0, 4);
+				obfuscate_font(header, candidate, length);
+				if(!candidate.empty() && (header == std::string("\0\1\0\0", 4) || header == "true" || header == "OTTO")) {
+					key = candidate;
+					break;
+				}
+			}
+			if(key.empty()) {
+				continue;
+			}
+			obfuscate_font(content, key, length);
+		}
+
+		std::string subset = subset_font(content, codepoints);
+		if(subset.empty()) {
+			continue;
+		}
+		// clang-format off
+		xprint(2, "Subset font: {} {} -> {} bytes\n",
+			file->lfh.file_name,
+			xstyled(content.size(), fg_bright_white),
+			xstyled(subset.size(), fg_green)
+		);
+		// clang-format on
+		obfuscate_font(subset, key, length);
+		file->set_content(std::move(subset));
+	}
+}
+
+// Compress entries in parallel, everything else is written in original order
+// by save_zip(). Largest entries are scheduled first so none of them is left
+// for the end.
+void App::compress_zip(Book& book) {
+	using clock = Book::clock;
+
+	Zip& zip = book.zip;
+	book.compressed.resize(zip.files.size());
+	book.times.resize(zip.files.size());
+	book.parts.resize(zip.files.size(), 1);
+	book.whole_sizes.resize(zip.files.size(), 0);
+	book.cached.resize(zip.files.size(), 0);
+	book.iterations.resize(zip.files.size(), 0);
+	book.methods.resize(zip.files.size(), Method::Zopfli);
+	book.fallback.resize(zip.files.size(), 0);
+	book.settings.resize(zip.files.size(), 0);
+	book.marked.resize(zip.files.size(), 0);
+	book.image_saved.resize(zip.files.size(), 0);
+	book.minify_saved.resize(zip.files.size(), 0);
+	book.same_as.resize(zip.files.size());
+	book.finished.resize(zip.files.size(), 1);
+	for(size_t i = 0; i < zip.files.size(); ++i) {
+		book.same_as[i] = i;
+	}
+	book.start = clock::now();
+
+	// First entries of every content hash and settings
+	std::map<std::tuple<uint32_t, uint32_t, uint32_t>, std::vector<size_t>> first_copies;
+
+	// Whitespace of XHTML is collapsed only when no style sheet can make it visible
+	bool collapse_spaces = true;
+	if(minify_) {
+		for(File& file : zip.files) {
+			if(mime_type(file.lfh.file_name) == "text/css" && css_affects_spaces(file.load())) {
+				collapse_spaces = false;
+			}
+		}
+	}
+
+	size_t split_size = static_cast<size_t>(split_size_) * 1024;
+	bool compare_split = log_level_ >= 3;
+
+	// Entries that wouldn't be finished by zopfli in time are compressed by
+	// libdeflate. Deadline of book is known once its first task starts.
+	auto total_deadline = clock::time_point::max();
+	if(total_time_budget_ > 0) {
+		auto total = std::chrono::duration_cast<clock::duration>(std::chrono::duration<double>(total_time_budget_));
+		total_deadline = run_start_ + total;
+	}
+	auto book_budget = std::chrono::duration_cast<clock::duration>(std::chrono::duration<double>(time_budget_));
+	bool budget = time_budget_ > 0 || total_time_budget_ > 0;
+
+	// Settings of entries. All copies are found before first task is
+	// scheduled, tasks change their entries.
+	struct Task {
+		CompressOptions const* options = nullptr;
+		bool split = false;
+		bool deflate = false;
+		std::string image;
+		std::string minify;
+		std::string id;
+		bool run = false;
+	};
+	std::vector<Task> tasks(zip.files.size());
+
+	for(size_t i = 0; i < zip.files.size(); ++i) {
+		File const& file = zip.files[i];
+		LFH const& lfh = file.lfh;
+		Task& task = tasks[i];
+		task.options = &compress_options(lfh.file_name);
+		task.split = split_size > 0 && lfh.uncompressed_size >= split_size && task.options->method == Method::Zopfli;
+		task.image = image_id(lfh.file_name);
+		task.minify = minify_id(lfh.file_name);
+		task.id = compress_id(*task.options);
+		if(task.split) {
+			task.id += ":split";
+		}
+
+		std::string settings = task.id;
+		for(auto const& transform : {task.image, task.minify}) {
+			if(!transform.empty()) {
+				settings += ":" + transform;
+			}
+		}
+		book.settings[i] = provenance_hash(settings);
+		task.deflate = lfh.compression_method == 8 && task.options->method != Method::Store;
+		if(!task.deflate && task.image.empty() && task.minify.empty()) {
+			continue;
+		}
+
+		// Stream written by previous run is kept as it is
+		if(!force_ && !file.modified && provenance_entry(file, book.settings[i])) {
+			book.marked[i] = 1;
+			continue;
+		}
+
+		// Copy of earlier entry isn't compressed again, see save_zip()
+		auto& copies = first_copies[{lfh.crc32, lfh.uncompressed_size, book.settings[i]}];
+		auto first = std::find_if(copies.begin(), copies.end(), [&](size_t j) { return same_content(zip.files[j], zip.files[i]); });
+		if(first != copies.end()) {
+			book.same_as[i] = *first;
+			zip.files[i].unload();
+			continue;
+		}
+		copies.push_back(i);
+		task.run = true;
+	}
+
+	size_t scheduled = 0;
+	for(size_t i = 0; i < zip.files.size(); ++i) {
+		if(!tasks[i].run) {
+			continue;
+		}
+		LFH const& lfh = zip.files[i].lfh;
+		CompressOptions const& options = *tasks[i].options;
+		bool split = tasks[i].split;
+		bool deflate = tasks[i].deflate;
+		std::string image = std::move(tasks[i].image);
+		std::string minify = std::move(tasks[i].minify);
+		std::string id = std::move(tasks[i].id);
+
+		// With budget entries with best expected gain per second go first.
+		// Zopfli saves few percent of deflate stream, but almost nothing of
+		// incompressible data, and its time grows with size and iterations.
+		uint64_t weight = lfh.uncompressed_size;
+		if(budget) {
+			double size = std::max(double(lfh.uncompressed_size), 1.0);
+			double ratio = lfh.compressed_size / size;
+			double gain = lfh.compressed_size * (ratio < 0.95 ? 0.05 : 0.002);
+			weight = static_cast<uint64_t>(gain / (size * options.iterations) * 1e12);
+		}
+
+		++scheduled;
+		book.finished[i] = 0;
+		// clang-format off
+		book.group.run([this, &book, &options, split, id, deflate, image, minify, collapse_spaces, compare_split, total_deadline, book_budget, i] {
+			// Entry is reported as done however task ends
+			struct Step {
+				Book& book;
+				size_t i;
+				~Step() { book.finish_entry(i); }
+			} step{book, i};
+
+			auto deadline = total_deadline;
+			auto begin = book.begin();
+			if(book_budget > clock::duration::zero()) {
+				deadline = std::min(deadline, begin + book_budget);
+			}
+
+			File& file = book.zip.files[i];
+			auto t = clock::now();
+			book.methods[i] = options.method;
+
+			if(!image.empty()) {
+				optimize_image(book, i, deadline);
+			}
+			if(!minify.empty()) {
+				minify_entry(book, i, collapse_spaces);
+			}
+			if(!deflate) {
+				book.times[i] = clock::now() - t;
+				file.unload();
+				return;
+			}
+
+			// Unchanged entry is looked up by its original stream first, so it
+			// doesn't have to be decompressed at all. Empty value means that
+			// original stream is already as small as we can get.
+			std::string stream_key;
+			if(cache_ && !file.modified) {
+				stream_key = Cache::stream_key(file.lfh.data, file.lfh.crc32, file.lfh.uncompressed_size, id);
+				if(cache_->get(stream_key, book.compressed[i])) {
+					book.cached[i] = 1;
+					book.times[i] = clock::now() - t;
+					return;
+				}
+			}
+
+			std::string_view content = file.load();
+
+			std::string key;
+			if(cache_) {
+				key = Cache::key(content, id);
+				book.cached[i] = cache_->get(key, book.compressed[i]);
+			}
+
+			if(!book.cached[i]) {
+				if(options.method != Method::Zopfli) {
+					book.compressed[i] = compress(content, options);
+				} else if(!compress_zopfli(book, i, content, options, split, deadline)) {
+					// Result of race or time limit isn't determined by content
+					// and settings, so it's not cached. Cached results are thus
+					// always made by options.method.
+					book.times[i] = clock::now() - t;
+					file.unload();
+					return;
+				}
+
+				if(cache_) {
+					cache_->put(key, book.compressed[i]);
+				}
+			}
+			book.times[i] = clock::now() - t;
+
+			if(!stream_key.empty()) {
+				bool smaller = book.compressed[i].size() < file.lfh.data.size();
+				cache_->put(stream_key, smaller ? std::string_view(book.compressed[i]) : std::string_view());
+			}
+
+			// Cost of splitting against single stream, doubles the work so only with -vvv
+			if(book.parts[i] > 1 && compare_split) {
+				book.whole_sizes[i] = compress(content, options).size();
+			}
+
+			file.unload();
+		}, weight);
+		// clang-format on
+	}
+
+	// Entries without task are done already
+	book.step(zip.files.size() - scheduled);
+}
+
+// Settings of image optimization of entry, empty if there is none
+std::string App::image_id(std::string_view file_name) const {
+	if(png_ && mime_type(file_name) == "image/png") {
+		// clang-format off
+		return fmt::format("png-{}:{}",
+			strip_name(png_strip_),
+			compress_id(compress_options_)
+		);
+		// clang-format on
+	}
+	if(jpeg_ && mime_type(file_name) == "image/jpeg") {
+		return fmt::format("jpeg-{}{}", strip_name(jpeg_strip_), jpeg_progressive_ ? "-progressive" : "");
+	}
+	return {};
+}
+
+// Replace image with optimized one. Images are recompressed with global
+// options, per type options apply to their zip entries.
+void App::optimize_image(Book& book, size_t i, std::chrono::steady_clock::time_point deadline) {
+	File& file = book.zip.files[i];
+	if(std::chrono::steady_clock::now() > deadline) {
+		return;
+	}
+
+	std::string_view content = file.load();
+	std::string id = image_id(file.lfh.file_name);
+
+	// Empty value means that image can't be made smaller
+	std::string optimized;
+	std::string key;
+	bool cached = false;
+	if(cache_) {
+		key = Cache::key(content, id);
+		cached = cache_->get(key, optimized);
+	}
+	if(!cached) {
+		if(mime_type(file.lfh.file_name) == "image/jpeg") {
+			optimized = optimize_jpeg(content, jpeg_progressive_, jpeg_strip_);
+		} else {
+			optimized = optimize_png(content, compress_options_, png_strip_);
+		}
+		if(cache_) {
+			cache_->put(key, optimized);
+		}
+	}
+
+	if(!optimized.empty() && optimized.size() < content.size()) {
+		book.image_saved[i] = static_cast<int64_t>(content.size()) - static_cast<int64_t>(optimized.size());
+		file.set_content(std::move(optimized));
+	}
+}
+
+// Settings of minification of entry, empty if there is none
+std::string App::minify_id(std::string_view file_name) const {
+	if(!minify_) {
+		return {};
+	}
+	std::string_view type = mime_type(file_name);
+	if(type == "text/css") {
+		return "minify-css";
+	}
+	if(type == "application/xhtml+xml" || type == "application/oebps-package+xml" || type == "application/x-dtbncx+xml") {
+		return "minify-xml";
+	}
+	return {};
+}
+
+// Replace text entry with minified one. Entry that can't be parsed or that
+// isn't UTF-8 is left as it is.
+void App::minify_entry(Book& book, size_t i, bool collapse_spaces) {
+	File& file = book.zip.files[i];
+	std::string_view content = file.load();
+	std::string_view type = mime_type(file.lfh.file_name);
+
+	std::string minified;
+	if(type == "text/css") {
+		minified = minify_css(content);
+	} else if(content.substr(0, 2) != "\xfe\xff" && content.substr(0, 2) != "\xff\xfe") {
+		try {
+			XML xml(content, XML::raw_options);
+			// Inline styles can change whitespace too
+			minified = xml.minify(type == "application/xhtml+xml", collapse_spaces && !css_affects_spaces(content));
+		} catch(std::exception const&) {
+		}
+	}
+
+	if(!minified.empty() && minified.size() < content.size()) {
+		book.minify_saved[i] = static_cast<int64_t>(content.size()) - static_cast<int64_t>(minified.size());
+		file.set_content(std::move(minified));
+	}
+}
+
+// Zopfli compression of entry, also with race against libdeflate and time
+// budget. Returns false if result depends on original stream or timing:
+// libdeflate won race or zopfli wouldn't make it before deadline, or
+// adaptive stages were cut by time limit.
+bool App::compress_zopfli(Book& book, size_t i, std::string_view content, CompressOptions const& options, bool split, std::chrono::steady_clock::time_point deadline) {
+	using clock = Book::clock;
+	File const& file = book.zip.files[i];
+
+	// Zopfli is usually about 4% smaller than libdeflate level 12 and gains
+	// nothing on data that libdeflate can't compress, so in race it runs
+	// only when expected result beats both cheap stream and original one.
+	std::string cheap;
+	if(options.race_gain > 0) {
+		cheap = compress_libdeflate(content, 12);
+		size_t best = file.modified ? cheap.size() : std::min(cheap.size(), file.lfh.data.size());
+		bool incompressible = cheap.size() * 50 > content.size() * 49;
+		auto expected = incompressible ? 0 : static_cast<int64_t>(best) - static_cast<int64_t>(cheap.size() * 96 / 100);
+		if(expected < options.race_gain) {
+			book.methods[i] = Method::Libdeflate;
+			book.compressed[i] = std::move(cheap);
+			return false;
+		}
+	}
+
+	double expected = zopfli_seconds(content.size(), options.iterations);
+	if(split) {
+		expected /= std::max(pool_->size(), 1u);
+	}
+	auto now = clock::now();
+	if(now + std::chrono::duration_cast<clock::duration>(std::chrono::duration<double>(expected)) > deadline) {
+		book.fallback[i] = 1;
+		book.methods[i] = Method::Libdeflate;
+		book.compressed[i] = cheap.empty() ? compress_libdeflate(content, 12) : std::move(cheap);
+		return false;
+	}
+
+	bool timed = false;
+	if(split) {
+		book.compressed[i] = compress_split(content, options, *pool_, &book.parts[i]);
+	} else if(options.min_gain > 0) {
+		// Adaptive stages also stop at deadline
+		CompressOptions o = options;
+		if(deadline != clock::time_point::max()) {
+			double left = std::chrono::duration<double>(deadline - now).count();
+			o.time_limit = o.time_limit > 0 ? std::min(o.time_limit, left) : left;
+		}
+		book.compressed[i] = compress_adaptive(content, o, &book.iterations[i]);
+		timed = o.time_limit > 0;
+	} else {
+		book.compressed[i] = compress(content, options);
+	}
+
+	if(!split) {
+		int iterations = book.iterations[i] > 0 ? book.iterations[i] : options.iterations;
+		auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(clock::now() - now).count();
+		zopfli_work_ += uint64_t(content.size()) * uint64_t(iterations);
+		zopfli_time_ += static_cast<uint64_t>(ns);
+	}
+	return !timed;
+}
+
+// Speed is averaged over all zopfli runs so far, starting from rough guess
+// of 2 MB per iteration per second.
+double App::zopfli_seconds(size_t size, int iterations) const {
+	constexpr double prior_work = 2e6;
+	constexpr double prior_time = 1e9;
+	double speed = (double(zopfli_work_) + prior_work) / (double(zopfli_time_) + prior_time);
+	return double(size) * iterations / speed / 1e9;
+}
+
+void App::save_zip(Book& book) {
+	using clock = Book::clock;
+
+	// Streamed archive can't be written at the end, its entries go out as
+	// soon as they are done and only central directory waits for the rest.
+	std::unique_ptr<ZipWriter> stream;
+	if(book.stream_output) {
+		stream = std::make_unique<ZipWriter>(fileno(stdout), book.output);
+	} else {
+		book.group.wait();
+	}
+
+	if(book.skip && stream) {
+		stream->copy(book.zip.content);
+		return;
+	}
+	if(book.skip && book.memory_output) {
+		book.memory_output->assign(book.zip.content);
+		return;
+	}
+	if(book.skip) {
+		std::error_code ec;
+		if(!fs::equivalent(book.input, book.output, ec)) {
+			fs::copy_file(book.input, book.output, fs::copy_options::overwrite_existing);
+		}
+		return;
+	}
+
+	Zip& zip = book.zip;
+
+	auto const& compressed = book.compressed;
+	auto const& times = book.times;
+	auto const& parts = book.parts;
+	auto const& whole_sizes = book.whole_sizes;
+
+	// Statistics of all entries, after all of them are done
+	auto report_compression = [&] {
+		auto wall = clock::now() - book.start;
+		auto cpu = clock::duration::zero();
+		size_t longest = 0;
+		size_t cache_hits = 0;
+		size_t fallbacks = 0;
+		for(size_t i = 0; i < times.size(); ++i) {
+			cpu += times[i];
+			if(times[i] > times[longest]) {
+				longest = i;
+			}
+			cache_hits += book.cached[i];
+			fallbacks += book.fallback[i];
+		}
+
+		if(cpu > clock::duration::zero()) {
+			// clang-format off
+			xprint(2, "{}: compressed in {:.3f}s (cpu {:.3f}s), longest entry {:.3f}s: {}\n",
+				book.input,
+				xstyled(seconds(wall), fg_bright_white),
+				xstyled(seconds(cpu), fg_bright_white),
+				xstyled(seconds(times[longest]), fg_bright_white),
+				zip.files[longest].lfh.file_name
+			);
+			// clang-format on
+		}
+		if(cache_) {
+			xprint(2, "{}: {} entries from cache\n", book.input, xstyled(cache_hits, fg_bright_white));
+		}
+		if(fallbacks > 0) {
+			xprint(2, "{}: {} entries over time budget\n", book.input, xstyled(fallbacks, fg_yellow));
+		}
+	};
+	if(!stream) {
+		report_compression();
+	}
+
+	std::vector<std::string_view> data_to_write(zip.files.size());
+	int64_t adaptive_spent = 0;
+	int64_t adaptive_fixed = 0;
+	int64_t adaptive_saved = 0;
+	int64_t images_saved = 0;
+	int64_t minify_saved = 0;
+	int64_t deflate_saved = 0;
+
+	for(size_t i = 0; i < zip.files.size(); ++i) {
+		File& file = zip.files[i];
+		LFH& lfh = file.lfh;
+
+		// Copies take over result of their first entry, which is done already
+		book.wait_entry(i);
+		size_t first = book.same_as[i];
+		if(first != i) {
+			if(zip.files[first].modified) {
+				file.set_content(zip.files[first].content);
+			}
+			book.compressed[i] = book.compressed[first];
+			book.methods[i] = book.methods[first];
+			book.fallback[i] = book.fallback[first];
+			book.image_saved[i] = book.image_saved[first];
+			book.minify_saved[i] = book.minify_saved[first];
+		}
 
 		xprint(2, "LFH({}/{}): {}\n", i + 1, zip.files.size(), lfh.file_name);
+		if(book.same_as[i] != i) {
+			xprint(2, " - same content as {}\n", zip.files[book.same_as[i]].lfh.file_name);
+		}
+		if(book.image_saved[i] > 0) {
+			xprint(2, " - image optimized, saved {} bytes\n", xstyled(book.image_saved[i], fg_green));
+			images_saved += book.image_saved[i];
+		}
+		if(book.minify_saved[i] > 0) {
+			xprint(2, " - minified, {} bytes smaller before compression\n", xstyled(book.minify_saved[i], fg_green));
+			minify_saved += book.minify_saved[i];
+		}
 
-		std::string v;
-		if(lfh.compression_method == 8) {
-			v = compress(zip.files[i].content);
-			uint32_t v_size = static_cast<uint32_t>(v.size());
-			auto d_size = lfh.compressed_size - v_size;
+		// Smallest of original stream (valid only for unchanged content),
+		// compressed and stored content is written.
+		std::string_view data = file.modified ? std::string_view(file.content) : lfh.data;
+		if(lfh.compression_method == 8 && compress_options(lfh.file_name).method == Method::Store) {
+			xprint(2, " - store\n");
+			data = file.load();
+			lfh.compression_method = 0;
+			lfh.compressed_size = static_cast<uint32_t>(data.size());
+		} else if(book.marked[i]) {
+			xprint(2, " - already repacked\n");
+		} else if(lfh.compression_method == 8) {
+			// Empty result is cache marker of already optimal original stream
+			std::string const& v = compressed[i];
+			bool optimal = !file.modified && v.empty();
+			auto d_size = optimal ? 0 : static_cast<int64_t>(lfh.compressed_size) - static_cast<int64_t>(v.size());
 			// clang-format off
-			xprint(2, " - zopfli saved {} bytes\n",
+			xprint(2, " - {} saved {} bytes in {:.3f}s{}\n",
+				method_name(book.methods[i]),
 				xstyled(d_size,
 					d_size > 0 ? fg_green :
 					d_size == 0 ? fg_bright_white :
 					fg_red
-				)
+				),
+				seconds(times[i]),
+				book.cached[i] ? " (cached)" : ""
 			);
+			deflate_saved += std::max(d_size, int64_t(0));
+			if(book.iterations[i] > 0) {
+				xprint(3, " - adaptive: {} iterations\n", book.iterations[i]);
+				adaptive_spent += book.iterations[i];
+				adaptive_fixed += compress_options(lfh.file_name).iterations;
+				adaptive_saved += std::max(d_size, int64_t(0));
+			}
+			if(parts[i] > 1) {
+				xprint(2, " - compressed as {} independent parts\n", parts[i]);
+			}
+			if(whole_sizes[i] > 0) {
+				auto cost = static_cast<int64_t>(v.size()) - static_cast<int64_t>(whole_sizes[i]);
+				xprint(3, " - single stream: {} bytes, splitting cost {} bytes\n",
+					whole_sizes[i],
+					xstyled(cost, cost > 0 ? fg_red : fg_green)
+				);
+			}
 			// clang-format on
-			lfh.compressed_size = v_size;
-		} else if(lfh.compression_method == 0) {
-			xprint(2, " - store\n");
-		}
 
-		write4(ofs, lfh.signature);
-		write2(ofs, lfh.version);
-		write2(ofs, lfh.bit_flag);
-		write2(ofs, lfh.compression_method);
-		write2(ofs, lfh.modification_time);
-		write2(ofs, lfh.modification_date);
-		write4(ofs, lfh.crc32);
-		write4(ofs, lfh.compressed_size);
-		write4(ofs, lfh.uncompressed_size);
-		write2(ofs, lfh.file_name_length);
-		write2(ofs, lfh.extra_field_length);
+			if(!file.modified && (optimal || lfh.data.size() <= v.size())) {
+				xprint(2, " - keep original\n");
+				data = lfh.data;
+			} else {
+				data = v;
+			}
 
-		write_str(lfh.file_name);
-		write_str(lfh.extra_field);
+			if(lfh.uncompressed_size < data.size()) {
+				xprint(2, " - store\n");
+				data = file.load();
+				lfh.compression_method = 0;
+			}
 
-		offsets.push_back(pos);
-		pos += 30 + lfh.file_name_length + lfh.extra_field_length;
+			lfh.compressed_size = static_cast<uint32_t>(data.size());
+		} else if(lfh.compression_method == 0) {
+			xprint(2, " - store\n");
+			lfh.compressed_size = static_cast<uint32_t>(data.size());
+		}
 
-		if(lfh.compression_method == 8) {
-			write_str(v);
-			pos += static_cast<uint32_t>(v.size());
-		} else {
-			write_str(lfh.data);
-			pos += static_cast<uint32_t>(lfh.data.size());
+		data_to_write[i] = data;
+		if(stream) {
+			stream->add(file, data);
 		}
 	}
 
-	uint32_t cdfh_pos = pos;
+	if(stream) {
+		book.group.wait();
+		report_compression();
+	}
 
+	// Markers of entries and of whole book if it was finished without shortcuts
+	bool complete = true;
+	book.extras.resize(zip.files.size());
 	for(size_t i = 0; i < zip.files.size(); ++i) {
-		LFH& lfh = zip.files[i].lfh;
 		CDFH& cdfh = zip.files[i].cdfh;
+		if(book.fallback[i]) {
+			complete = false;
+			book.extras[i] = provenance_strip(cdfh.extra_field);
+		} else {
+			book.extras[i] = provenance_extra(cdfh.extra_field, book.settings[i], zip.files[i].lfh.compressed_size);
+		}
+		if(book.extras[i].size() <= UINT16_MAX) {
+			cdfh.extra_field = book.extras[i];
+			cdfh.extra_field_length = static_cast<uint16_t>(book.extras[i].size());
+		}
+	}
+	if(complete) {
+		book.comment = provenance_comment(zip.eocd.comment, provenance_, zip.files);
+		if(book.comment.size() <= UINT16_MAX) {
+			zip.eocd.comment = book.comment;
+			zip.eocd.comment_length = static_cast<uint16_t>(book.comment.size());
+		}
+	}
 
-		xprint(2, "CDFH({}/{}): {}\n", i + 1, zip.files.size(), lfh.file_name);
-
-		write4(ofs, cdfh.signature);
-		write2(ofs, cdfh.version_made_by);
-		write2(ofs, cdfh.version_needed);
-
-		write2(ofs, lfh.bit_flag);
-		write2(ofs, lfh.compression_method);
-		write2(ofs, lfh.modification_time);
-		write2(ofs, lfh.modification_date);
-		write4(ofs, lfh.crc32);
-		write4(ofs, lfh.compressed_size);
-		write4(ofs, lfh.uncompressed_size);
-		write2(ofs, lfh.file_name_length);
-
-		write2(ofs, cdfh.extra_field_length);
-		write2(ofs, cdfh.file_comment_length);
-		write2(ofs, cdfh.disk_number);
-		write2(ofs, cdfh.internal_file_attributes);
-		write4(ofs, cdfh.external_file_attributes);
-		write4(ofs, offsets[i]);
-
-		write_str(lfh.file_name);
-		write_str(cdfh.extra_field);
-		write_str(cdfh.file_comment);
+	if(images_saved > 0) {
+		xprint(2, "{}: images optimized, saved {} bytes\n", book.input, xstyled(images_saved, fg_bright_white));
+	}
+	if(minify_saved > 0) {
+		// clang-format off
+		xprint(2, "{}: minification removed {} bytes of text, compressed entries saved {} bytes\n",
+			book.input,
+			xstyled(minify_saved, fg_bright_white),
+			xstyled(deflate_saved, fg_bright_white)
+		);
+		// clang-format on
+	}
 
-		pos += 46 + lfh.file_name_length + cdfh.extra_field_length + cdfh.file_comment_length;
+	if(adaptive_fixed > 0) {
+		// clang-format off
+		xprint(2, "{}: adaptive compression spent {} iterations (fixed count {}), saved {} bytes\n",
+			book.input,
+			xstyled(adaptive_spent, fg_bright_white),
+			xstyled(adaptive_fixed, fg_bright_white),
+			xstyled(adaptive_saved, fg_bright_white)
+		);
+		// clang-format on
 	}
 
-	EOCD& eocd = zip.eocd;
+	auto write = [&](ZipWriter& writer) {
+		auto write_start = clock::now();
+		writer.preallocate(ZipWriter::archive_size(zip.files, data_to_write, zip.eocd));
+		for(size_t i = 0; i < zip.files.size(); ++i) {
+			writer.add(zip.files[i], data_to_write[i]);
+		}
+		writer.finish(zip.eocd);
 
-	xprint(2, "EOCD\n");
+		// clang-format off
+		xprint(2, "{}: written {} bytes in {:.3f}s\n",
+			book.output,
+			xstyled(writer.size(), fg_bright_white),
+			xstyled(seconds(clock::now() - write_start), fg_bright_white)
+		);
+		// clang-format on
+	};
 
-	write4(ofs, eocd.signature);
-	write2(ofs, eocd.number_of_this_disk);
-	write2(ofs, eocd.central_directory_disk_no);
-	write2(ofs, eocd.entries_in_this_disk);
-	write2(ofs, eocd.total_entries);
-	write4(ofs, pos - cdfh_pos);
-	write4(ofs, cdfh_pos);
-	write2(ofs, eocd.comment_length);
+	if(stream) {
+		stream->finish(zip.eocd);
+		xprint(2, "{}: written {} bytes\n", book.output, xstyled(stream->size(), fg_bright_white));
+		return;
+	}
+	if(book.memory_output) {
+		ZipWriter writer(book.memory_output);
+		write(writer);
+		return;
+	}
 
-	write_str(eocd.comment);
+	// Input is mapped into memory and may be the same file as output,
+	// so new archive is written aside and moved into place when complete.
+	std::string tmp_output = book.output + ".tmp";
+	try {
+		ZipWriter writer(tmp_output);
+		write(writer);
+	} catch(...) {
+		std::error_code ec;
+		fs::remove(tmp_output, ec);
+		throw;
+	}
+	fs::rename(tmp_output, book.output);
 }
 
@@ -0,0 +1,181 @@
+#include "cache.hpp"
+#include "utils.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <exception>
+#include <fstream>
+#include <functional>
+#include <iterator>
+#include <thread>
+#include <vector>
+
+#include <fmt/core.h>
+
+#ifdef _WIN32
+#include <process.h>
+#define getpid _getpid
+#else
+#include <unistd.h>
+#endif
+
+// clang-format off
+// Layout of cache file:
+//   "ERC1"
+//   key length (2 bytes) | key
+//   crc32 of value (4 bytes) | value
+// clang-format on
+static constexpr std::string_view magic = "ERC1";
+
+static void append2(std::string& str, uint16_t value) {
+	str.push_back(static_cast<char>(value >> 0));
+	str.push_back(static_cast<char>(value >> 8));
+}
+
+static void append4(std::string& str, uint32_t value) {
+	append2(str, static_cast<uint16_t>(value >> 0));
+	append2(str, static_cast<uint16_t>(value >> 16));
+}
+
+Cache::Cache(std::string const& dir, uint64_t max_size) : dir_(dir), max_size_(max_size) {
+	std::error_code ec;
+	fs::create_directories(dir_, ec);
+	if(!fs::is_directory(dir_)) {
+		throw std::runtime_error(fmt::format("Can't create cache directory \"{}\"", dir));
+	}
+}
+
+std::string Cache::key(std::string_view data, std::string_view settings) {
+	return fmt::format("{}:{}:{}", to_hex(sha1(data)), data.size(), settings);
+}
+
+std::string Cache::stream_key(std::string_view stream, uint32_t crc, uint32_t size, std::string_view settings) {
+	return fmt::format("stream:{}:{}:{:08x}:{}:{}", to_hex(sha1(stream)), stream.size(), crc, size, settings);
+}
+
+fs::path Cache::path(std::string const& key) const {
+	std::string name = to_hex(sha1(key));
+	return dir_ / name.substr(0, 2) / name.substr(2);
+}
+
+bool Cache::get(std::string const& key, std::string& value) {
+	fs::path p = path(key);
+
+	std::ifstream file(p, std::ios::binary);
+	if(!file) {
+		return false;
+	}
+	std::string str(std::istreambuf_iterator{file}, {});
+
+	// Anything unexpected is treated as miss, file will be replaced by put().
+	size_t header = magic.size() + 2;
+	if(str.size() < header || std::string_view(str).substr(0, magic.size()) != magic) {
+		return false;
+	}
+	size_t key_size = read2(str, magic.size());
+	if(str.size() < header + key_size + 4 || std::string_view(str).substr(header, key_size) != key) {
+		return false;
+	}
+	uint32_t crc = read4(str, header + key_size);
+	std::string_view data = std::string_view(str).substr(header + key_size + 4);
+	if(crc32(data) != crc) {
+		return false;
+	}
+
+	// Mark as recently used
+	std::error_code ec;
+	fs::last_write_time(p, fs::file_time_type::clock::now(), ec);
+
+	value = std::string(data);
+	return true;
+}
+
+void Cache::put(std::string const& key, std::string_view value) {
+	fs::path p = path(key);
+
+	std::string str(magic);
+	append2(str, static_cast<uint16_t>(key.size()));
+	str += key;
+	append4(str, crc32(value));
+	str += value;
+
+	// Unique name of temporary file across processes and threads
+	static std::atomic<uint64_t> counter{0};
+	auto now = std::chrono::steady_clock::now().time_since_epoch().count();
+	auto tid = std::hash<std::thread::id>{}(std::this_thread::get_id());
+	fs::path tmp = p;
+	tmp += fmt::format(".{:x}-{:x}-{:x}-{:x}.tmp", getpid(), now, tid, counter++);
+
+	std::error_code ec;
+	fs::create_directories(p.parent_path(), ec);
+	{
+		std::ofstream file(tmp, std::ios::binary);
+		file.write(str.data(), static_cast<std::streamsize>(str.size()));
+		if(!file) {
+			file.close();
+			fs::remove(tmp, ec);
+			return;
+		}
+	}
+
+	fs::rename(tmp, p, ec);
+	if(ec) {
+		fs::remove(tmp, ec);
+	}
+}
+
+void Cache::trim() {
+	struct Entry {
+		fs::file_time_type time;
+		uint64_t size;
+		fs::path path;
+	};
+
+	// Temporary files left by killed processes
+	auto stale = fs::file_time_type::clock::now() - std::chrono::hours(1);
+
+	std::vector<Entry> entries;
+	uint64_t total = 0;
+
+	std::error_code ec;
+	for(fs::recursive_directory_iterator it(dir_, ec), end; !ec && it != end; it.increment(ec)) {
+		std::error_code entry_ec;
+		if(!it->is_regular_file(entry_ec)) {
+			continue;
+		}
+
+		auto time = it->last_write_time(entry_ec);
+		if(it->path().extension() == ".tmp") {
+			if(!entry_ec && time < stale) {
+				fs::remove(it->path(), entry_ec);
+			}
+			continue;
+		}
+
+		uint64_t size = it->file_size(entry_ec);
+		if(entry_ec) {
+			continue;
+		}
+		entries.push_back(Entry{time, size, it->path()});
+		total += size;
+	}
+
+	if(total <= max_size_) {
+		return;
+	}
+
+	// clang-format off
+	std::sort(entries.begin(), entries.end(),
+		[](Entry const& a, Entry const& b) { return a.time < b.time; });
+	// clang-format on
+
+	// Other process may be removing same files at the same time, that's fine.
+	for(auto const& entry : entries) {
+		if(total <= max_size_) {
+			break;
+		}
+		fs::remove(entry.path, ec);
+		total -= entry.size;
+	}
+}
@@ -0,0 +1,125 @@
+#include "css.hpp"
+
+#include <algorithm>
+#include <cctype>
+
+static bool is_space(char c) {
+	return c == ' ' || c == '\t' || c == '\n' || c == '\r' || c == '\f';
+}
+
+// Whitespace before or after these never separates tokens. Colon is only
+// tight on its right side, "a :hover" and "a:hover" are different selectors.
+static bool tight_before(char c) {
+	return c == '{' || c == '}' || c == ';' || c == ',' || c == '>' || c == ')' || c == '!';
+}
+
+static bool tight_after(char c) {
+	return c == '{' || c == '}' || c == ';' || c == ',' || c == '>' || c == '(' || c == ':';
+}
+
+static bool starts_with_nocase(std::string_view str, size_t pos, std::string_view prefix) {
+	if(str.size() - pos < prefix.size()) {
+		return false;
+	}
+	for(size_t i = 0; i < prefix.size(); ++i) {
+		if(std::tolower(static_cast<unsigned char>(str[pos + i])) != prefix[i]) {
+			return false;
+		}
+	}
+	return true;
+}
+
+std::string minify_css(std::string_view css) {
+	std::string ret;
+	ret.reserve(css.size());
+	bool space = false;
+
+	size_t i = 0;
+	while(i < css.size()) {
+		char c = css[i];
+
+		if(is_space(c)) {
+			space = true;
+			++i;
+			continue;
+		}
+
+		if(c == '/' && i + 1 < css.size() && css[i + 1] == '*') {
+			size_t end = css.find("*/", i + 2);
+			if(end == std::string_view::npos) {
+				return {};
+			}
+			if(i + 2 < css.size() && css[i + 2] == '!') {
+				ret.append(css.substr(i, end + 2 - i));
+			} else {
+				// Comment separates tokens like whitespace does
+				space = true;
+			}
+			i = end + 2;
+			continue;
+		}
+
+		if(space && !ret.empty() && !tight_after(ret.back()) && !tight_before(c)) {
+			ret += ' ';
+		}
+		space = false;
+
+		if(c == '"' || c == '\'') {
+			size_t end = i + 1;
+			while(end < css.size() && css[end] != c) {
+				end += css[end] == '\\' ? 2 : 1;
+			}
+			if(end >= css.size()) {
+				return {};
+			}
+			ret.append(css.substr(i, end + 1 - i));
+			i = end + 1;
+		} else if(c == '\\') {
+			// Hex escape ends with one optional whitespace that belongs to it
+			size_t end = i + 1;
+			while(end < css.size() && end < i + 7 && std::isxdigit(static_cast<unsigned char>(css[end]))) {
+				++end;
+			}
+			if(end == i + 1 || (end < css.size() && is_space(css[end]))) {
+				++end;
+			}
+			end = std::min(end, css.size());
+			ret.append(css.substr(i, end - i));
+			i = end;
+		} else if(starts_with_nocase(css, i, "url(") && (ret.empty() || !std::isalnum(static_cast<unsigned char>(ret.back())))) {
+			size_t end = i + 4;
+			while(end < css.size() && is_space(css[end])) {
+				++end;
+			}
+			if(end < css.size() && (css[end] == '"' || css[end] == '\'')) {
+				// Quoted url is string token, rest is handled as usual
+				ret.append(css.substr(i, 4));
+				i += 4;
+			} else {
+				end = css.find(')', end);
+				if(end == std::string_view::npos) {
+					return {};
+				}
+				ret.append(css.substr(i, end + 1 - i));
+				i = end + 1;
+			}
+		} else {
+			if(c == '}' && !ret.empty() && ret.back() == ';') {
+				ret.pop_back();
+			}
+			ret += c;
+			++i;
+		}
+	}
+
+	return ret;
+}
+
+bool css_affects_spaces(std::string_view css) {
+	for(size_t i = 0; i < css.size(); ++i) {
+		if(starts_with_nocase(css, i, "white-space") || starts_with_nocase(css, i, "inline")) {
+			return true;
+		}
+	}
+	return false;
+}
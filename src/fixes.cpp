@@ -0,0 +1,129 @@
+#include "fixes.hpp"
+
+#include "opf.hpp"
+#include "utils.hpp"
+
+#include <exception>
+
+Documents::Documents(Zip& zip) : zip_(zip) {
+}
+
+std::string const& Documents::rootfile() {
+	if(!has_rootfile_) {
+		has_rootfile_ = true;
+		XML* container = xml("META-INF/container.xml");
+		try {
+			rootfile_ = container ? container->get_rootfile() : std::string();
+		} catch(std::exception const&) {
+		}
+	}
+	return rootfile_;
+}
+
+Documents::Document* Documents::find(std::string const& path) {
+	auto it = documents_.find(path);
+	if(it != documents_.end()) {
+		return &it->second;
+	}
+	File* file = zip_.find_file(path);
+	if(!file) {
+		return nullptr;
+	}
+	Document& document = documents_[path];
+	document.file = file;
+	document.text = std::string(file->load());
+	file->unload();
+	return &document;
+}
+
+void Documents::load(std::vector<std::string> const& paths) {
+	for(auto const& path : paths) {
+		find(path);
+	}
+}
+
+// Text of document changed through its tree, pretty printed if it can't be
+// written as it was read
+static void write_back(std::string const& path, std::string& text, XML& xml) {
+	std::string raw = xml.to_raw_string(mime_type(path) == "application/xhtml+xml");
+	text = raw.empty() ? xml.to_string() : std::move(raw);
+}
+
+std::string* Documents::text(std::string const& path) {
+	Document* document = find(path);
+	if(!document) {
+		return nullptr;
+	}
+	// Tree would be stale after text is changed
+	if(document->xml && document->changed) {
+		write_back(path, document->text, *document->xml);
+	}
+	document->xml.reset();
+	document->parsed = false;
+	return &document->text;
+}
+
+XML* Documents::xml(std::string const& path) {
+	Document* document = find(path);
+	if(!document) {
+		return nullptr;
+	}
+	if(!document->parsed) {
+		document->parsed = true;
+		try {
+			document->xml = std::make_unique<XML>(document->text, XML::raw_options);
+		} catch(std::exception const&) {
+		}
+	}
+	return document->xml.get();
+}
+
+void Documents::changed(std::string const& path) {
+	if(Document* document = find(path)) {
+		document->changed = true;
+	}
+}
+
+std::vector<std::string> Documents::commit() {
+	std::vector<std::string> paths;
+	for(auto& [path, document] : documents_) {
+		if(!document.changed) {
+			continue;
+		}
+		if(document.xml) {
+			write_back(path, document.text, *document.xml);
+		}
+		document.file->set_content(std::move(document.text));
+		paths.push_back(path);
+	}
+	documents_.clear();
+	return paths;
+}
+
+static std::vector<std::string> package_document(Documents& documents) {
+	std::string const& rootfile = documents.rootfile();
+	if(rootfile.empty()) {
+		return {};
+	}
+	return {rootfile};
+}
+
+static bool fix_series(Documents& documents, std::vector<std::string> const& paths) {
+	std::string* opf = paths.empty() ? nullptr : documents.text(paths[0]);
+	std::string fixed = opf ? fix_series_metadata(*opf) : std::string();
+	if(fixed.empty()) {
+		return false;
+	}
+	*opf = std::move(fixed);
+	documents.changed(paths[0]);
+	return true;
+}
+
+std::vector<Fixer> const& fixers() {
+	// clang-format off
+	static std::vector<Fixer> const fixers = {
+		{Fix::Series, "series", "fix series information for PocketBook", package_document, fix_series},
+	};
+	// clang-format on
+	return fixers;
+}
@@ -0,0 +1,562 @@
+#include "font.hpp"
+
+#include "utils.hpp"
+
+#include <algorithm>
+#include <cctype>
+#include <functional>
+#include <map>
+#include <stdexcept>
+#include <vector>
+
+namespace {
+
+// Big endian reads with bounds check, malformed font throws
+struct Bytes {
+	std::string_view data;
+
+	void check(size_t offset, size_t size) const {
+		if(offset > data.size() || data.size() - offset < size) {
+			throw std::out_of_range("font: offset out of range");
+		}
+	}
+	uint8_t u8(size_t offset) const {
+		check(offset, 1);
+		return static_cast<uint8_t>(data[offset]);
+	}
+	uint16_t u16(size_t offset) const {
+		check(offset, 2);
+		return static_cast<uint16_t>((u8(offset) << 8) | u8(offset + 1));
+	}
+	uint32_t u24(size_t offset) const {
+		return (uint32_t(u8(offset)) << 16) | u16(offset + 1);
+	}
+	uint32_t u32(size_t offset) const {
+		return (uint32_t(u16(offset)) << 16) | u16(offset + 2);
+	}
+	Bytes sub(size_t offset, size_t size) const {
+		check(offset, size);
+		return Bytes{data.substr(offset, size)};
+	}
+	Bytes sub(size_t offset) const {
+		check(offset, 0);
+		return Bytes{data.substr(offset)};
+	}
+};
+
+void put16(std::string& str, uint32_t value) {
+	str.push_back(static_cast<char>(value >> 8));
+	str.push_back(static_cast<char>(value));
+}
+
+void put32(std::string& str, uint32_t value) {
+	put16(str, value >> 16);
+	put16(str, value & 0xffff);
+}
+
+void set32(std::string& str, size_t offset, uint32_t value) {
+	for(int i = 0; i < 4; ++i) {
+		str[offset + i] = static_cast<char>(value >> (24 - 8 * i));
+	}
+}
+
+uint32_t checksum(std::string_view data) {
+	uint32_t sum = 0;
+	for(size_t i = 0; i < data.size(); i += 4) {
+		uint32_t word = 0;
+		for(size_t j = 0; j < 4; ++j) {
+			word = (word << 8) | (i + j < data.size() ? static_cast<uint8_t>(data[i + j]) : 0);
+		}
+		sum += word;
+	}
+	return sum;
+}
+
+// Other case of letter for scripts with simple case mapping
+char32_t other_case(char32_t c) {
+	// clang-format off
+	if((c >= 'a' && c <= 'z') || (c >= 0xe0 && c <= 0xfe && c != 0xf7) || (c >= 0x3b1 && c <= 0x3c9 && c != 0x3c2) || (c >= 0x430 && c <= 0x44f)) {
+		return c - 0x20;
+	}
+	if((c >= 'A' && c <= 'Z') || (c >= 0xc0 && c <= 0xde && c != 0xd7) || (c >= 0x391 && c <= 0x3a9) || (c >= 0x410 && c <= 0x42f)) {
+		return c + 0x20;
+	}
+	// clang-format on
+	if(c >= 0x400 && c <= 0x40f) {
+		return c + 0x50;
+	}
+	if(c >= 0x450 && c <= 0x45f) {
+		return c - 0x50;
+	}
+	if(c == 0xff) {
+		return 0x178;
+	}
+	if(c == 0x178) {
+		return 0xff;
+	}
+	// Latin Extended-A pairs, odd or even first depending on range
+	if((c >= 0x100 && c <= 0x137) || (c >= 0x14a && c <= 0x177)) {
+		return c ^ 1;
+	}
+	if((c >= 0x139 && c <= 0x148) || (c >= 0x179 && c <= 0x17e)) {
+		return c & 1 ? c + 1 : c - 1;
+	}
+	return c;
+}
+
+using GlyphCallback = std::function<void(char32_t codepoint, uint32_t glyph)>;
+
+// Mappings of cmap subtable. False if format isn't supported.
+bool cmap_mappings(Bytes table, GlyphCallback const& callback) {
+	uint16_t format = table.u16(0);
+	switch(format) {
+		case 0:
+			for(uint32_t c = 0; c < 256; ++c) {
+				callback(c, table.u8(6 + c));
+			}
+			return true;
+		case 4: {
+			size_t segments = table.u16(6) / 2;
+			size_t ends = 14;
+			size_t starts = ends + segments * 2 + 2;
+			size_t deltas = starts + segments * 2;
+			size_t range_offsets = deltas + segments * 2;
+			for(size_t i = 0; i < segments; ++i) {
+				uint32_t end = table.u16(ends + i * 2);
+				uint32_t start = table.u16(starts + i * 2);
+				uint16_t delta = table.u16(deltas + i * 2);
+				uint16_t range_offset = table.u16(range_offsets + i * 2);
+				for(uint32_t c = start; c <= end && c != 0xffff; ++c) {
+					uint32_t glyph = c;
+					if(range_offset != 0) {
+						glyph = table.u16(range_offsets + i * 2 + range_offset + (c - start) * 2);
+						if(glyph == 0) {
+							continue;
+						}
+					}
+					callback(c, (glyph + delta) & 0xffff);
+				}
+			}
+			return true;
+		}
+		case 6: {
+			uint32_t first = table.u16(6);
+			uint32_t count = table.u16(8);
+			for(uint32_t i = 0; i < count; ++i) {
+				callback(first + i, table.u16(10 + i * 2));
+			}
+			return true;
+		}
+		case 12: {
+			uint32_t groups = table.u32(12);
+			for(uint32_t i = 0; i < groups; ++i) {
+				uint32_t start = table.u32(16 + i * 12);
+				uint32_t end = std::min<uint32_t>(table.u32(20 + i * 12), 0x10ffff);
+				uint32_t glyph = table.u32(24 + i * 12);
+				for(uint32_t c = start; c <= end; ++c) {
+					callback(c, glyph + (c - start));
+				}
+			}
+			return true;
+		}
+		case 14: {
+			// Only non-default variation glyphs differ from base mapping
+			uint32_t records = table.u32(6);
+			for(uint32_t i = 0; i < records; ++i) {
+				uint32_t non_default = table.u32(10 + i * 11 + 7);
+				if(non_default == 0) {
+					continue;
+				}
+				uint32_t mappings = table.u32(non_default);
+				for(uint32_t j = 0; j < mappings; ++j) {
+					callback(table.u24(non_default + 4 + j * 5), table.u16(non_default + 4 + j * 5 + 3));
+				}
+			}
+			return true;
+		}
+		default:
+			return false;
+	}
+}
+
+void coverage_glyphs(Bytes coverage, std::function<void(uint32_t)> const& callback) {
+	uint16_t format = coverage.u16(0);
+	if(format == 1) {
+		uint16_t count = coverage.u16(2);
+		for(uint32_t i = 0; i < count; ++i) {
+			callback(coverage.u16(4 + i * 2));
+		}
+	} else if(format == 2) {
+		uint16_t count = coverage.u16(2);
+		for(uint32_t i = 0; i < count; ++i) {
+			uint32_t start = coverage.u16(4 + i * 6);
+			uint32_t end = coverage.u16(6 + i * 6);
+			for(uint32_t glyph = start; glyph <= end; ++glyph) {
+				callback(glyph);
+			}
+		}
+	} else {
+		throw std::runtime_error("font: unknown coverage format");
+	}
+}
+
+// Glyphs written by substitution subtable (any lookup of GSUB)
+void substitution_outputs(Bytes subtable, uint16_t type, std::vector<uint8_t>& keep) {
+	auto mark = [&](uint32_t glyph) {
+		if(glyph < keep.size()) {
+			keep[glyph] = 1;
+		}
+	};
+	auto array = [&](size_t offset) {
+		uint16_t count = subtable.u16(offset);
+		for(uint32_t i = 0; i < count; ++i) {
+			mark(subtable.u16(offset + 2 + i * 2));
+		}
+	};
+	uint16_t format = subtable.u16(0);
+
+	switch(type) {
+		case 1:
+			if(format == 1) {
+				uint16_t delta = subtable.u16(4);
+				coverage_glyphs(subtable.sub(subtable.u16(2)), [&](uint32_t glyph) { mark((glyph + delta) & 0xffff); });
+			} else {
+				array(4);
+			}
+			break;
+		case 2:
+		case 3: {
+			// Sequences of multiple substitution, sets of alternates
+			uint16_t count = subtable.u16(4);
+			for(uint32_t i = 0; i < count; ++i) {
+				array(subtable.u16(6 + i * 2));
+			}
+			break;
+		}
+		case 4: {
+			uint16_t sets = subtable.u16(4);
+			for(uint32_t i = 0; i < sets; ++i) {
+				Bytes set = subtable.sub(subtable.u16(6 + i * 2));
+				uint16_t ligatures = set.u16(0);
+				for(uint32_t j = 0; j < ligatures; ++j) {
+					mark(set.u16(set.u16(2 + j * 2)));
+				}
+			}
+			break;
+		}
+		case 7:
+			substitution_outputs(subtable.sub(subtable.u32(4)), subtable.u16(2), keep);
+			break;
+		case 8: {
+			size_t offset = 4;
+			offset += 2 + subtable.u16(offset) * 2;  // backtrack coverages
+			offset += 2 + subtable.u16(offset) * 2;  // lookahead coverages
+			array(offset);
+			break;
+		}
+		default:
+			// Contextual substitutions only call other lookups
+			break;
+	}
+}
+
+void gsub_outputs(Bytes gsub, std::vector<uint8_t>& keep) {
+	Bytes lookups = gsub.sub(gsub.u16(8));
+	uint16_t count = lookups.u16(0);
+	for(uint32_t i = 0; i < count; ++i) {
+		Bytes lookup = lookups.sub(lookups.u16(2 + i * 2));
+		uint16_t type = lookup.u16(0);
+		uint16_t subtables = lookup.u16(4);
+		for(uint32_t j = 0; j < subtables; ++j) {
+			substitution_outputs(lookup.sub(lookup.u16(6 + j * 2)), type, keep);
+		}
+	}
+}
+
+struct Table {
+	uint32_t tag;
+	std::string_view data;
+};
+
+constexpr uint32_t tag(char const (&name)[5]) {
+	return (uint32_t(uint8_t(name[0])) << 24) | (uint32_t(uint8_t(name[1])) << 16) | (uint32_t(uint8_t(name[2])) << 8) | uint8_t(name[3]);
+}
+
+std::string subset(std::string_view font, std::set<char32_t> const& codepoints) {
+	Bytes file{font};
+	uint32_t version = file.u32(0);
+	if(version != 0x00010000 && version != tag("true")) {
+		return {};
+	}
+
+	std::map<uint32_t, std::string_view> tables;
+	std::vector<Table> order;
+	uint16_t count = file.u16(4);
+	for(uint32_t i = 0; i < count; ++i) {
+		size_t record = 12 + i * 16;
+		Table table{file.u32(record), file.sub(file.u32(record + 8), file.u32(record + 12)).data};
+		tables[table.tag] = table.data;
+		order.push_back(table);
+	}
+
+	// clang-format off
+	for(uint32_t unsupported : {tag("CFF "), tag("CFF2"), tag("gvar"), tag("COLR"), tag("SVG "), tag("CBDT"),
+			tag("sbix"), tag("EBDT"), tag("morx"), tag("mort"), tag("MATH")}) {
+		if(tables.count(unsupported)) {
+			return {};
+		}
+	}
+	// clang-format on
+	for(uint32_t required : {tag("head"), tag("maxp"), tag("loca"), tag("glyf"), tag("cmap")}) {
+		if(!tables.count(required)) {
+			return {};
+		}
+	}
+
+	Bytes head{tables[tag("head")]};
+	Bytes glyf{tables[tag("glyf")]};
+	Bytes loca{tables[tag("loca")]};
+	Bytes cmap{tables[tag("cmap")]};
+	size_t glyphs = Bytes{tables[tag("maxp")]}.u16(4);
+	bool long_loca = head.u16(50) != 0;
+	auto offset = [&](size_t glyph) -> size_t {
+		return long_loca ? loca.u32(glyph * 4) : size_t(loca.u16(glyph * 2)) * 2;
+	};
+
+	// Glyphs not mapped from Unicode are reachable only some other way and kept
+	std::vector<uint8_t> keep(glyphs, 0);
+	std::vector<uint8_t> mapped(glyphs, 0);
+	keep[0] = 1;
+	uint16_t subtables = cmap.u16(2);
+	for(uint32_t i = 0; i < subtables; ++i) {
+		uint16_t platform = cmap.u16(4 + i * 8);
+		uint16_t encoding = cmap.u16(6 + i * 8);
+		if(platform == 1) {
+			// Legacy Macintosh mapping, readers use Unicode one
+			continue;
+		}
+		bool unicode = platform == 0 || (platform == 3 && (encoding == 1 || encoding == 10));
+		Bytes table = cmap.sub(cmap.u32(8 + i * 8));
+		bool known = cmap_mappings(table, [&](char32_t c, uint32_t glyph) {
+			if(glyph < glyphs) {
+				mapped[glyph] = 1;
+				keep[glyph] |= !unicode || codepoints.count(c) > 0;
+			}
+		});
+		if(!known) {
+			return {};
+		}
+	}
+	for(size_t glyph = 0; glyph < glyphs; ++glyph) {
+		keep[glyph] |= !mapped[glyph];
+	}
+	if(tables.count(tag("GSUB"))) {
+		gsub_outputs(Bytes{tables[tag("GSUB")]}, keep);
+	}
+
+	// Components of composite glyphs
+	std::vector<size_t> pending;
+	for(size_t glyph = 0; glyph < glyphs; ++glyph) {
+		if(keep[glyph]) {
+			pending.push_back(glyph);
+		}
+	}
+	while(!pending.empty()) {
+		size_t glyph = pending.back();
+		pending.pop_back();
+		size_t begin = offset(glyph);
+		if(offset(glyph + 1) <= begin || static_cast<int16_t>(glyf.u16(begin)) >= 0) {
+			continue;
+		}
+
+		uint16_t flags = 0x20;
+		for(size_t pos = begin + 10; flags & 0x20;) {
+			flags = glyf.u16(pos);
+			uint16_t component = glyf.u16(pos + 2);
+			if(component < glyphs && !keep[component]) {
+				keep[component] = 1;
+				pending.push_back(component);
+			}
+			pos += 4 + (flags & 0x01 ? 4 : 2);
+			pos += flags & 0x08 ? 2 : flags & 0x40 ? 4 : flags & 0x80 ? 8 : 0;
+		}
+	}
+
+	std::string new_glyf;
+	std::string new_loca;
+	for(size_t glyph = 0; glyph <= glyphs; ++glyph) {
+		if(long_loca) {
+			put32(new_loca, static_cast<uint32_t>(new_glyf.size()));
+		} else {
+			put16(new_loca, static_cast<uint32_t>(new_glyf.size() / 2));
+		}
+		if(glyph < glyphs && keep[glyph]) {
+			size_t begin = offset(glyph);
+			size_t end = offset(glyph + 1);
+			if(end > begin) {
+				new_glyf.append(glyf.sub(begin, end - begin).data);
+			}
+		}
+	}
+	if(new_glyf.size() >= glyf.data.size()) {
+		return {};
+	}
+
+	// Tables in original order, signature is no longer valid
+	std::vector<std::pair<uint32_t, std::string>> out;
+	for(auto const& table : order) {
+		if(table.tag == tag("DSIG")) {
+			continue;
+		}
+		std::string data(table.data);
+		if(table.tag == tag("glyf")) {
+			data = new_glyf;
+		} else if(table.tag == tag("loca")) {
+			data = new_loca;
+		} else if(table.tag == tag("head")) {
+			set32(data, 8, 0);
+		}
+		out.emplace_back(table.tag, std::move(data));
+	}
+
+	uint16_t tables_count = static_cast<uint16_t>(out.size());
+	uint16_t power = 1;
+	uint16_t selector = 0;
+	while(power * 2 <= tables_count) {
+		power *= 2;
+		++selector;
+	}
+
+	std::string ret;
+	put32(ret, version);
+	put16(ret, tables_count);
+	put16(ret, power * 16);
+	put16(ret, selector);
+	put16(ret, tables_count * 16 - power * 16);
+
+	size_t data_offset = ret.size() + out.size() * 16;
+	std::vector<std::pair<uint32_t, std::string>> sorted(out);
+	std::sort(sorted.begin(), sorted.end(), [](auto const& a, auto const& b) { return a.first < b.first; });
+	std::map<uint32_t, size_t> offsets;
+	for(auto const& [t, data] : out) {
+		offsets[t] = data_offset;
+		data_offset += (data.size() + 3) & ~size_t(3);
+	}
+	for(auto const& [t, data] : sorted) {
+		put32(ret, t);
+		put32(ret, checksum(data));
+		put32(ret, static_cast<uint32_t>(offsets[t]));
+		put32(ret, static_cast<uint32_t>(data.size()));
+	}
+	size_t head_offset = 0;
+	for(auto const& [t, data] : out) {
+		if(t == tag("head")) {
+			head_offset = ret.size();
+		}
+		ret += data;
+		ret.append((4 - data.size() % 4) % 4, '\0');
+	}
+	set32(ret, head_offset + 8, 0xb1b0afba - checksum(ret));
+
+	if(ret.size() >= font.size()) {
+		return {};
+	}
+	return ret;
+}
+
+}  // namespace
+
+void add_codepoints(std::set<char32_t>& codepoints, std::string_view text) {
+	auto add = [&](char32_t c) {
+		codepoints.insert(c);
+		codepoints.insert(other_case(c));
+	};
+
+	for(size_t i = 0; i < text.size();) {
+		auto b = static_cast<uint8_t>(text[i]);
+		size_t length = b < 0x80 ? 1 : b >= 0xf0 ? 4 : b >= 0xe0 ? 3 : b >= 0xc0 ? 2 : 1;
+		char32_t c = length == 1 ? b : b & (0x3f >> (length - 1));
+		for(size_t j = 1; j < length && i + j < text.size(); ++j) {
+			c = (c << 6) | (static_cast<uint8_t>(text[i + j]) & 0x3f);
+		}
+		add(c);
+		i += length;
+
+		// CSS escape, e.g. content: "\2192"
+		if(c == '\\') {
+			size_t end = i;
+			while(end < text.size() && end < i + 6 && std::isxdigit(static_cast<unsigned char>(text[end]))) {
+				++end;
+			}
+			if(end > i) {
+				add(static_cast<char32_t>(std::stoul(std::string(text.substr(i, end - i)), nullptr, 16)));
+			}
+		}
+	}
+}
+
+std::set<char32_t> default_codepoints() {
+	std::set<char32_t> ret;
+	for(char32_t c = 0x20; c < 0x7f; ++c) {
+		ret.insert(c);
+	}
+	// clang-format off
+	for(char32_t c : {
+		0xa0, 0xad, 0x2010, 0x2011, 0x2013, 0x2014, 0x2018, 0x2019, 0x201c, 0x201d, 0x2022, 0x2026,
+		0x25a0, 0x25aa, 0x25cb, 0x25cc, 0x25e6, 0xfffd
+	}) {
+		ret.insert(c);
+	}
+	// clang-format on
+	return ret;
+}
+
+std::string subset_font(std::string_view font, std::set<char32_t> const& codepoints) {
+	try {
+		return subset(font, codepoints);
+	} catch(std::exception const&) {
+		return {};
+	}
+}
+
+std::string idpf_font_key(std::string_view identifier) {
+	std::string stripped;
+	for(char c : identifier) {
+		if(c != ' ' && c != '\t' && c != '\r' && c != '\n') {
+			stripped += c;
+		}
+	}
+	return sha1(stripped);
+}
+
+std::string adobe_font_key(std::string_view identifier) {
+	std::string_view prefix = "urn:uuid:";
+	if(identifier.substr(0, prefix.size()) == prefix) {
+		identifier.remove_prefix(prefix.size());
+	}
+	std::string key;
+	std::string digits;
+	for(char c : identifier) {
+		if(c == '-') {
+			continue;
+		}
+		if(!std::isxdigit(static_cast<unsigned char>(c))) {
+			return {};
+		}
+		digits += c;
+		if(digits.size() == 2) {
+			key += static_cast<char>(std::stoi(digits, nullptr, 16));
+			digits.clear();
+		}
+	}
+	return key.size() == 16 && digits.empty() ? key : std::string();
+}
+
+void obfuscate_font(std::string& font, std::string_view key, size_t length) {
+	if(key.empty()) {
+		return;
+	}
+	for(size_t i = 0; i < std::min(length, font.size()); ++i) {
+		font[i] = static_cast<char>(font[i] ^ key[i % key.size()]);
+	}
+}
@@ -0,0 +1,214 @@
+#include "jpeg.hpp"
+
+#include <csetjmp>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include <jpeglib.h>
+
+namespace {
+
+struct ErrorManager {
+	jpeg_error_mgr pub;
+	std::jmp_buf jump;
+};
+
+void error_exit(j_common_ptr info) {
+	std::longjmp(reinterpret_cast<ErrorManager*>(info->err)->jump, 1);
+}
+
+void output_message(j_common_ptr) {
+}
+
+void init_error(ErrorManager& err) {
+	jpeg_std_error(&err.pub);
+	err.pub.error_exit = error_exit;
+	err.pub.output_message = output_message;
+}
+
+bool marker_is(jpeg_saved_marker_ptr m, int marker, std::string_view id) {
+	return m->marker == marker && m->data_length >= id.size() && std::memcmp(m->data, id.data(), id.size()) == 0;
+}
+
+// Orientation tag of Exif, 0 if there is none
+unsigned exif_orientation(jpeg_saved_marker_ptr m) {
+	constexpr std::string_view exif("Exif\0\0", 6);
+	if(!marker_is(m, JPEG_APP0 + 1, exif)) {
+		return 0;
+	}
+
+	const JOCTET* tiff = m->data + exif.size();
+	size_t size = m->data_length - exif.size();
+	if(size < 8 || (tiff[0] != 'I' && tiff[0] != 'M')) {
+		return 0;
+	}
+	bool le = tiff[0] == 'I';
+	auto r2 = [&](size_t o) -> uint32_t {
+		return le ? tiff[o] | (tiff[o + 1] << 8) : (tiff[o] << 8) | tiff[o + 1];
+	};
+	auto r4 = [&](size_t o) -> uint32_t {
+		return le ? r2(o) | (r2(o + 2) << 16) : (r2(o) << 16) | r2(o + 2);
+	};
+
+	size_t ifd = r4(4);
+	if(ifd + 2 > size) {
+		return 0;
+	}
+	size_t count = r2(ifd);
+	for(size_t i = 0; i < count && ifd + 2 + (i + 1) * 12 <= size; ++i) {
+		size_t entry = ifd + 2 + i * 12;
+		if(r2(entry) == 0x0112) {
+			return r2(entry + 8);
+		}
+	}
+	return 0;
+}
+
+bool keep_marker(jpeg_saved_marker_ptr m, ImageStrip strip, j_compress_ptr dst) {
+	// Written by libjpeg itself
+	if(dst->write_JFIF_header && marker_is(m, JPEG_APP0, std::string_view("JFIF\0", 5))) {
+		return false;
+	}
+	bool adobe = marker_is(m, JPEG_APP0 + 14, "Adobe");
+	if(adobe && dst->write_Adobe_marker) {
+		return false;
+	}
+
+	if(strip == ImageStrip::None || adobe) {
+		return true;
+	}
+	if(strip == ImageStrip::All) {
+		return false;
+	}
+	// Exif is kept only when viewer needs it to rotate image
+	return marker_is(m, JPEG_APP0 + 2, std::string_view("ICC_PROFILE\0", 12)) || exif_orientation(m) > 1;
+}
+
+// Copy coefficients of input into *out allocated by libjpeg. Nothing with
+// destructor may live here, errors longjmp back to setjmp.
+bool transcode(std::string_view in, bool progressive, ImageStrip strip, unsigned char** out, unsigned long* out_size) {
+	ErrorManager err;
+	init_error(err);
+	jpeg_decompress_struct src;
+	jpeg_compress_struct dst;
+	src.err = &err.pub;
+	dst.err = &err.pub;
+	jpeg_create_decompress(&src);
+	jpeg_create_compress(&dst);
+
+	if(setjmp(err.jump)) {
+		jpeg_destroy_compress(&dst);
+		jpeg_destroy_decompress(&src);
+		return false;
+	}
+
+	jpeg_mem_src(&src, reinterpret_cast<unsigned char*>(const_cast<char*>(in.data())), static_cast<unsigned long>(in.size()));
+	jpeg_save_markers(&src, JPEG_COM, 0xFFFF);
+	for(int i = 0; i < 16; ++i) {
+		jpeg_save_markers(&src, JPEG_APP0 + i, 0xFFFF);
+	}
+	jpeg_read_header(&src, TRUE);
+	jvirt_barray_ptr* coefficients = jpeg_read_coefficients(&src);
+
+	// Corrupt data is read with warnings and would be written repaired.
+	// Counter is reset when compression starts.
+	if(err.pub.num_warnings > 0) {
+		jpeg_destroy_compress(&dst);
+		jpeg_destroy_decompress(&src);
+		return false;
+	}
+
+	jpeg_copy_critical_parameters(&src, &dst);
+	dst.optimize_coding = TRUE;
+	if(progressive || src.progressive_mode) {
+		jpeg_simple_progression(&dst);
+	}
+	jpeg_mem_dest(&dst, out, out_size);
+	jpeg_write_coefficients(&dst, coefficients);
+
+	for(auto m = src.marker_list; m; m = m->next) {
+		if(keep_marker(m, strip, &dst)) {
+			jpeg_write_marker(&dst, m->marker, m->data, m->data_length);
+		}
+	}
+
+	jpeg_finish_compress(&dst);
+	jpeg_finish_decompress(&src);
+	jpeg_destroy_compress(&dst);
+	jpeg_destroy_decompress(&src);
+	return true;
+}
+
+// Both images decode to same quantization tables and DCT coefficients
+bool same_coefficients(std::string_view a, std::string_view b) {
+	ErrorManager err;
+	init_error(err);
+	jpeg_decompress_struct da;
+	jpeg_decompress_struct db;
+	da.err = &err.pub;
+	db.err = &err.pub;
+	jpeg_create_decompress(&da);
+	jpeg_create_decompress(&db);
+
+	if(setjmp(err.jump)) {
+		jpeg_destroy_decompress(&da);
+		jpeg_destroy_decompress(&db);
+		return false;
+	}
+
+	jpeg_mem_src(&da, reinterpret_cast<unsigned char*>(const_cast<char*>(a.data())), static_cast<unsigned long>(a.size()));
+	jpeg_mem_src(&db, reinterpret_cast<unsigned char*>(const_cast<char*>(b.data())), static_cast<unsigned long>(b.size()));
+	jpeg_read_header(&da, TRUE);
+	jpeg_read_header(&db, TRUE);
+	jvirt_barray_ptr* ca = jpeg_read_coefficients(&da);
+	jvirt_barray_ptr* cb = jpeg_read_coefficients(&db);
+
+	bool same = da.num_components == db.num_components && da.image_width == db.image_width &&
+		da.image_height == db.image_height && da.jpeg_color_space == db.jpeg_color_space;
+	for(int ci = 0; same && ci < da.num_components; ++ci) {
+		jpeg_component_info const& pa = da.comp_info[ci];
+		jpeg_component_info const& pb = db.comp_info[ci];
+		// clang-format off
+		same = pa.h_samp_factor == pb.h_samp_factor && pa.v_samp_factor == pb.v_samp_factor
+			&& pa.width_in_blocks == pb.width_in_blocks && pa.height_in_blocks == pb.height_in_blocks
+			&& pa.quant_table && pb.quant_table
+			&& std::memcmp(pa.quant_table->quantval, pb.quant_table->quantval, sizeof(pa.quant_table->quantval)) == 0;
+		// clang-format on
+
+		for(JDIMENSION row = 0; same && row < pa.height_in_blocks; ++row) {
+			JBLOCKARRAY ra = da.mem->access_virt_barray(reinterpret_cast<j_common_ptr>(&da), ca[ci], row, 1, FALSE);
+			JBLOCKARRAY rb = db.mem->access_virt_barray(reinterpret_cast<j_common_ptr>(&db), cb[ci], row, 1, FALSE);
+			same = std::memcmp(ra[0], rb[0], pa.width_in_blocks * sizeof(JBLOCK)) == 0;
+		}
+	}
+
+	jpeg_destroy_decompress(&da);
+	jpeg_destroy_decompress(&db);
+	return same;
+}
+
+}  // namespace
+
+std::string optimize_jpeg(std::string_view jpeg, bool progressive, ImageStrip strip) {
+	std::string best(jpeg);
+	for(bool p : {false, true}) {
+		if(p && !progressive) {
+			break;
+		}
+
+		unsigned char* out = nullptr;
+		unsigned long out_size = 0;
+		bool ok = transcode(jpeg, p, strip, &out, &out_size);
+		std::string_view result(reinterpret_cast<char*>(out), ok ? out_size : 0);
+		if(ok && result.size() < best.size() && same_coefficients(jpeg, result)) {
+			best = result;
+		}
+		free(out);
+	}
+
+	if(best.size() >= jpeg.size()) {
+		return {};
+	}
+	return best;
+}
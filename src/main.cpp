@@ -11,7 +11,7 @@ int main(int argc, char** argv) {
 	} catch(std::exception const& e) {
 		// clang-format off
 
-		fmt::print("{}\n  {}\n",
+		fmt::print(stderr, "{}\n  {}\n",
 			app.xstyled("Error:", App::fg_red),
 			app.xstyled(e.what(), App::fg_red)
 		);
@@ -0,0 +1,275 @@
+#include "opf.hpp"
+
+#include <algorithm>
+#include <utility>
+#include <vector>
+
+namespace {
+
+constexpr size_t npos = std::string_view::npos;
+
+bool is_space(char c) {
+	return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+}
+
+bool starts_with(std::string_view str, size_t pos, std::string_view prefix) {
+	return str.substr(pos, prefix.size()) == prefix;
+}
+
+struct Tag {
+	size_t begin = npos;  // '<'
+	size_t end = npos;    // after '>'
+	std::string_view name;
+	bool closing = false;  // </name>
+	bool empty = false;    // <name/>
+};
+
+size_t after(std::string_view xml, size_t pos, std::string_view close) {
+	size_t end = xml.find(close, pos);
+	return end == npos ? npos : end + close.size();
+}
+
+// Next element tag at or after pos. Comments, CDATA, processing
+// instructions and DOCTYPE are skipped. Tag with begin npos at end of
+// document or if markup is unterminated.
+Tag next_tag(std::string_view xml, size_t pos) {
+	while(pos != npos && (pos = xml.find('<', pos)) != npos) {
+		if(starts_with(xml, pos, "<!--")) {
+			pos = after(xml, pos + 4, "-->");
+		} else if(starts_with(xml, pos, "<![CDATA[")) {
+			pos = after(xml, pos + 9, "]]>");
+		} else if(starts_with(xml, pos, "<?")) {
+			pos = after(xml, pos + 2, "?>");
+		} else if(starts_with(xml, pos, "<!")) {
+			// Internal subset of DOCTYPE may contain '>'
+			size_t subset = xml.find('[', pos);
+			size_t end = xml.find('>', pos);
+			pos = subset < end ? after(xml, subset, "]>") : after(xml, pos, ">");
+		} else {
+			Tag tag;
+			tag.begin = pos;
+			tag.closing = starts_with(xml, pos, "</");
+			size_t i = pos + (tag.closing ? 2 : 1);
+			size_t name = i;
+			while(i < xml.size() && !is_space(xml[i]) && xml[i] != '>' && xml[i] != '/') {
+				++i;
+			}
+			tag.name = xml.substr(name, i - name);
+
+			// Quoted values may contain '>'
+			char quote = 0;
+			for(; i < xml.size() && (quote || xml[i] != '>'); ++i) {
+				if(quote) {
+					quote = xml[i] == quote ? 0 : quote;
+				} else if(xml[i] == '"' || xml[i] == '\'') {
+					quote = xml[i];
+				}
+			}
+			if(i == xml.size()) {
+				return {};
+			}
+			tag.end = i + 1;
+			tag.empty = xml[i - 1] == '/';
+			return tag;
+		}
+	}
+	return {};
+}
+
+struct Attribute {
+	std::string_view name;
+	std::string_view value;
+	std::string_view text;  // name="value" as written
+};
+
+// Attributes of start tag, false if they can't be read
+bool read_attributes(Tag const& tag, std::string_view xml, std::vector<Attribute>& attributes) {
+	size_t end = tag.end - (tag.empty ? 2 : 1);
+	size_t i = tag.begin + 1 + tag.name.size();
+	while(true) {
+		while(i < end && is_space(xml[i])) {
+			++i;
+		}
+		if(i == end) {
+			return true;
+		}
+
+		Attribute attribute;
+		size_t begin = i;
+		while(i < end && !is_space(xml[i]) && xml[i] != '=') {
+			++i;
+		}
+		attribute.name = xml.substr(begin, i - begin);
+		while(i < end && is_space(xml[i])) {
+			++i;
+		}
+		if(i == end || xml[i] != '=') {
+			return false;
+		}
+		++i;
+		while(i < end && is_space(xml[i])) {
+			++i;
+		}
+		if(i == end || (xml[i] != '"' && xml[i] != '\'')) {
+			return false;
+		}
+		size_t close = xml.find(xml[i], i + 1);
+		if(close >= end) {
+			return false;
+		}
+		attribute.value = xml.substr(i + 1, close - i - 1);
+		i = close + 1;
+		attribute.text = xml.substr(begin, i - begin);
+		attributes.push_back(attribute);
+	}
+}
+
+// Direct child element of <metadata>, with whitespace before it
+struct Child {
+	size_t begin;
+	Tag start;
+	size_t end;
+};
+
+}  // namespace
+
+std::string fix_series_metadata(std::string_view opf) {
+	Tag package = next_tag(opf, 0);
+	if(package.begin == npos || package.closing || package.empty || package.name != "package") {
+		return {};
+	}
+
+	// <metadata> is child of root
+	Tag metadata;
+	int depth = 0;
+	for(Tag tag = next_tag(opf, package.end); depth >= 0; tag = next_tag(opf, tag.end)) {
+		if(tag.begin == npos) {
+			return {};
+		}
+		if(depth == 0 && !tag.closing && tag.name == "metadata") {
+			metadata = tag;
+			break;
+		}
+		depth += tag.closing ? -1 : tag.empty ? 0 : 1;
+	}
+	if(metadata.begin == npos || metadata.empty) {
+		return {};
+	}
+
+	std::vector<Child> children;
+	size_t close = npos;
+	depth = 0;
+	for(Tag tag = next_tag(opf, metadata.end); close == npos; tag = next_tag(opf, tag.end)) {
+		if(tag.begin == npos) {
+			return {};
+		}
+		if(tag.closing) {
+			if(depth == 0) {
+				close = tag.begin;
+			} else if(--depth == 0) {
+				children.back().end = tag.end;
+			}
+		} else if(depth == 0) {
+			size_t begin = tag.begin;
+			while(begin > metadata.end && is_space(opf[begin - 1])) {
+				--begin;
+			}
+			children.push_back({begin, tag, tag.end});
+			depth += tag.empty ? 0 : 1;
+		} else {
+			depth += tag.empty ? 0 : 1;
+		}
+	}
+
+	// Start tag of <meta> with name and content first
+	std::vector<Attribute> attributes;
+	auto meta_tag = [&](Tag const& tag, std::string& out) {
+		attributes.clear();
+		// Iterators are taken after reading, it may reallocate. Tag that
+		// can't be read is copied as it is.
+		bool ok = tag.name == "meta" && read_attributes(tag, opf, attributes);
+		if(!ok) {
+			out.append(opf.substr(tag.begin, tag.end - tag.begin));
+			return;
+		}
+		auto name = std::find_if(attributes.begin(), attributes.end(), [](Attribute const& a) { return a.name == "name"; });
+		auto content = std::find_if(attributes.begin(), attributes.end(), [](Attribute const& a) { return a.name == "content"; });
+		bool ordered = name == attributes.begin() && (content == attributes.end() || content == attributes.begin() + 1);
+		if(name == attributes.end() || ordered) {
+			out.append(opf.substr(tag.begin, tag.end - tag.begin));
+			return;
+		}
+
+		std::vector<Attribute> order{*name};
+		if(content != attributes.end()) {
+			order.push_back(*content);
+		}
+		for(auto it = attributes.begin(); it != attributes.end(); ++it) {
+			if(it != name && it != content) {
+				order.push_back(*it);
+			}
+		}
+		out += "<meta";
+		for(auto const& attribute : order) {
+			out += ' ';
+			out.append(attribute.text);
+		}
+		out += tag.empty ? "/>" : ">";
+	};
+	auto meta_name = [&](Child const& child) -> std::string_view {
+		attributes.clear();
+		if(child.start.name != "meta" || !read_attributes(child.start, opf, attributes)) {
+			return {};
+		}
+		for(auto const& attribute : attributes) {
+			if(attribute.name == "name") {
+				return attribute.value;
+			}
+		}
+		return {};
+	};
+
+	Child const* series = nullptr;
+	Child const* index = nullptr;
+	for(auto const& child : children) {
+		std::string_view name = meta_name(child);
+		if(!series && name == "calibre:series") {
+			series = &child;
+		} else if(!index && name == "calibre:series_index") {
+			index = &child;
+		}
+	}
+
+	std::string inner;
+	inner.reserve(close - metadata.end + 64);
+	auto append = [&](Child const& child) {
+		inner.append(opf.substr(child.begin, child.start.begin - child.begin));
+		meta_tag(child.start, inner);
+		inner.append(opf.substr(child.start.end, child.end - child.start.end));
+	};
+	size_t pos = metadata.end;
+	for(auto const& child : children) {
+		inner.append(opf.substr(pos, child.begin - pos));
+		if(&child != series && &child != index) {
+			append(child);
+		}
+		pos = child.end;
+	}
+	for(Child const* moved : {series, index}) {
+		if(moved) {
+			append(*moved);
+		}
+	}
+	inner.append(opf.substr(pos, close - pos));
+
+	if(inner == opf.substr(metadata.end, close - metadata.end)) {
+		return {};
+	}
+
+	std::string ret;
+	ret.reserve(opf.size() - (close - metadata.end) + inner.size());
+	ret.append(opf.substr(0, metadata.end));
+	ret.append(inner);
+	ret.append(opf.substr(close));
+	return ret;
+}
@@ -0,0 +1,340 @@
+#include "png.hpp"
+
+#include <algorithm>
+#include <cstdlib>
+#include <vector>
+
+#include <libdeflate.h>
+
+static constexpr std::string_view signature = "\x89PNG\r\n\x1a\n";
+
+namespace {
+
+struct Chunk {
+	std::string_view type;
+	std::string_view data;
+};
+
+// Rows of one interlace pass (or of whole image without interlacing)
+struct Pass {
+	size_t rows;
+	size_t row_bytes;
+};
+
+uint32_t read4be(std::string_view str, size_t offset) {
+	auto b = [&](size_t i) { return uint32_t(static_cast<uint8_t>(str[offset + i])); };
+	return (b(0) << 24) | (b(1) << 16) | (b(2) << 8) | b(3);
+}
+
+void append4be(std::string& str, uint32_t value) {
+	str.push_back(static_cast<char>(value >> 24));
+	str.push_back(static_cast<char>(value >> 16));
+	str.push_back(static_cast<char>(value >> 8));
+	str.push_back(static_cast<char>(value >> 0));
+}
+
+void append_chunk(std::string& png, std::string_view type, std::string_view data) {
+	append4be(png, static_cast<uint32_t>(data.size()));
+	std::string body(type);
+	body += data;
+	png += body;
+	append4be(png, crc32(body));
+}
+
+bool parse_chunks(std::string_view png, std::vector<Chunk>& chunks) {
+	if(png.substr(0, signature.size()) != signature) {
+		return false;
+	}
+
+	size_t pos = signature.size();
+	while(pos + 12 <= png.size()) {
+		uint32_t length = read4be(png, pos);
+		if(length > png.size() - pos - 12) {
+			return false;
+		}
+		std::string_view body = png.substr(pos + 4, 4 + length);
+		if(crc32(body) != read4be(png, pos + 8 + length)) {
+			return false;
+		}
+		chunks.push_back(Chunk{body.substr(0, 4), body.substr(4)});
+		pos += 12 + length;
+		if(chunks.back().type == "IEND") {
+			return true;
+		}
+	}
+	return false;
+}
+
+uint8_t paeth(uint8_t a, uint8_t b, uint8_t c) {
+	int p = int(a) + int(b) - int(c);
+	int pa = std::abs(p - int(a));
+	int pb = std::abs(p - int(b));
+	int pc = std::abs(p - int(c));
+	if(pa <= pb && pa <= pc) {
+		return a;
+	}
+	return pb <= pc ? b : c;
+}
+
+// Value predicted for byte x of row by filter type
+uint8_t predict(int type, uint8_t a, uint8_t b, uint8_t c) {
+	switch(type) {
+		case 1:
+			return a;
+		case 2:
+			return b;
+		case 3:
+			return static_cast<uint8_t>((int(a) + int(b)) / 2);
+		case 4:
+			return paeth(a, b, c);
+		default:
+			return 0;
+	}
+}
+
+// Filtered image data (filter byte + row) to raw rows. False if malformed.
+bool unfilter(std::string_view filtered, std::vector<Pass> const& passes, size_t bpp, std::string& raw) {
+	raw.clear();
+	size_t pos = 0;
+	for(auto const& pass : passes) {
+		size_t start = raw.size();
+		for(size_t y = 0; y < pass.rows; ++y) {
+			if(pos + 1 + pass.row_bytes > filtered.size()) {
+				return false;
+			}
+			int type = static_cast<uint8_t>(filtered[pos]);
+			if(type > 4) {
+				return false;
+			}
+			size_t row = raw.size();
+			raw.append(filtered.substr(pos + 1, pass.row_bytes));
+			for(size_t x = 0; x < pass.row_bytes; ++x) {
+				uint8_t a = x >= bpp ? uint8_t(raw[row + x - bpp]) : 0;
+				uint8_t b = row > start ? uint8_t(raw[row - pass.row_bytes + x]) : 0;
+				uint8_t c = x >= bpp && row > start ? uint8_t(raw[row - pass.row_bytes + x - bpp]) : 0;
+				raw[row + x] = static_cast<char>(uint8_t(raw[row + x]) + predict(type, a, b, c));
+			}
+			pos += 1 + pass.row_bytes;
+		}
+	}
+	return pos == filtered.size();
+}
+
+// Raw rows to filtered data. Strategy 0-4 uses that filter for all rows,
+// 5 picks filter with minimal sum of absolute differences for every row.
+std::string filter(std::string_view raw, std::vector<Pass> const& passes, size_t bpp, int strategy) {
+	std::string ret;
+	std::string candidate;
+	size_t pos = 0;
+	for(auto const& pass : passes) {
+		size_t start = pos;
+		for(size_t y = 0; y < pass.rows; ++y) {
+			auto filter_row = [&](int type, std::string& out) {
+				out.push_back(static_cast<char>(type));
+				for(size_t x = 0; x < pass.row_bytes; ++x) {
+					uint8_t a = x >= bpp ? uint8_t(raw[pos + x - bpp]) : 0;
+					uint8_t b = pos > start ? uint8_t(raw[pos - pass.row_bytes + x]) : 0;
+					uint8_t c = x >= bpp && pos > start ? uint8_t(raw[pos - pass.row_bytes + x - bpp]) : 0;
+					out.push_back(static_cast<char>(uint8_t(raw[pos + x]) - predict(type, a, b, c)));
+				}
+			};
+
+			if(strategy < 5) {
+				filter_row(strategy, ret);
+			} else {
+				std::string best;
+				uint64_t best_sum = UINT64_MAX;
+				for(int type = 0; type <= 4; ++type) {
+					candidate.clear();
+					filter_row(type, candidate);
+					uint64_t sum = 0;
+					for(size_t x = 1; x < candidate.size(); ++x) {
+						sum += uint64_t(std::abs(int(static_cast<int8_t>(candidate[x]))));
+					}
+					if(sum < best_sum) {
+						best_sum = sum;
+						best.swap(candidate);
+					}
+				}
+				ret += best;
+			}
+			pos += pass.row_bytes;
+		}
+	}
+	return ret;
+}
+
+std::string zlib_wrap(std::string_view deflate, std::string_view data) {
+	std::string ret = "\x78\xda";
+	ret += deflate;
+	append4be(ret, libdeflate_adler32(1, data.data(), data.size()));
+	return ret;
+}
+
+bool zlib_inflate(std::string_view in, size_t size, std::string& out) {
+	out.assign(size, '\0');
+	auto d = libdeflate_alloc_decompressor();
+	size_t actual = 0;
+	auto result = libdeflate_zlib_decompress(d, in.data(), in.size(), out.data(), out.size(), &actual);
+	libdeflate_free_decompressor(d);
+	return result == LIBDEFLATE_SUCCESS && actual == size;
+}
+
+bool keep_chunk(std::string_view type, ImageStrip strip) {
+	// Critical chunks have uppercase first letter
+	if(type[0] >= 'A' && type[0] <= 'Z') {
+		return true;
+	}
+	if(type == "tRNS" || strip == ImageStrip::None) {
+		return true;
+	}
+	if(strip == ImageStrip::All) {
+		return false;
+	}
+	// clang-format off
+	return type == "gAMA" || type == "cHRM" || type == "sRGB" || type == "iCCP"
+		|| type == "sBIT" || type == "cICP";
+	// clang-format on
+}
+
+}  // namespace
+
+std::string optimize_png(std::string_view png, CompressOptions const& options, ImageStrip strip) {
+	std::vector<Chunk> chunks;
+	if(!parse_chunks(png, chunks) || chunks.front().type != "IHDR" || chunks.front().data.size() != 13) {
+		return {};
+	}
+
+	std::string idat;
+	for(auto const& chunk : chunks) {
+		// Animated PNG keeps frames in fdAT chunks bound to sequence numbers
+		if(chunk.type == "acTL") {
+			return {};
+		}
+		bool known = chunk.type == "IHDR" || chunk.type == "PLTE" || chunk.type == "IDAT" || chunk.type == "IEND";
+		if(chunk.type[0] >= 'A' && chunk.type[0] <= 'Z' && !known) {
+			return {};
+		}
+		if(chunk.type == "IDAT") {
+			idat += chunk.data;
+		}
+	}
+
+	std::string_view ihdr = chunks.front().data;
+	size_t width = read4be(ihdr, 0);
+	size_t height = read4be(ihdr, 4);
+	unsigned depth = static_cast<uint8_t>(ihdr[8]);
+	unsigned color = static_cast<uint8_t>(ihdr[9]);
+	unsigned interlace = static_cast<uint8_t>(ihdr[12]);
+	if(ihdr[10] != 0 || ihdr[11] != 0 || interlace > 1) {
+		return {};
+	}
+
+	unsigned channels = 0;
+	switch(color) {
+		case 0:
+		case 3:
+			channels = 1;
+			break;
+		case 2:
+			channels = 3;
+			break;
+		case 4:
+			channels = 2;
+			break;
+		case 6:
+			channels = 4;
+			break;
+		default:
+			return {};
+	}
+	size_t bits = size_t(channels) * depth;
+	size_t bpp = std::max<size_t>(bits / 8, 1);
+	if(width == 0 || height == 0 || width > (1u << 24) || height > (1u << 24)) {
+		return {};
+	}
+
+	// clang-format off
+	static constexpr size_t adam7[7][4] = {
+		{0, 0, 8, 8}, {4, 0, 8, 8}, {0, 4, 4, 8}, {2, 0, 4, 4},
+		{0, 2, 2, 4}, {1, 0, 2, 2}, {0, 1, 1, 2}
+	};
+	// clang-format on
+	std::vector<Pass> passes;
+	if(interlace == 0) {
+		passes.push_back(Pass{height, (width * bits + 7) / 8});
+	} else {
+		for(auto const& [x0, y0, dx, dy] : adam7) {
+			size_t w = width > x0 ? (width - x0 + dx - 1) / dx : 0;
+			size_t h = height > y0 ? (height - y0 + dy - 1) / dy : 0;
+			if(w > 0 && h > 0) {
+				passes.push_back(Pass{h, (w * bits + 7) / 8});
+			}
+		}
+	}
+
+	size_t filtered_size = 0;
+	for(auto const& pass : passes) {
+		filtered_size += pass.rows * (1 + pass.row_bytes);
+	}
+
+	if(filtered_size > (size_t(1) << 28)) {
+		return {};
+	}
+
+	std::string filtered;
+	std::string raw;
+	if(!zlib_inflate(idat, filtered_size, filtered) || !unfilter(filtered, passes, bpp, raw)) {
+		return {};
+	}
+
+	// Candidates are ranked by fast compression, only best one gets options.
+	// Palette and low bit depth images usually do best without filtering.
+	std::vector<std::string> candidates;
+	candidates.push_back(filtered);
+	for(int strategy = 0; strategy <= 5; ++strategy) {
+		candidates.push_back(filter(raw, passes, bpp, strategy));
+	}
+	size_t best = 0;
+	size_t best_size = SIZE_MAX;
+	for(size_t i = 0; i < candidates.size(); ++i) {
+		size_t size = compress_libdeflate(candidates[i], 12).size();
+		if(size < best_size) {
+			best_size = size;
+			best = i;
+		}
+	}
+
+	std::string data = zlib_wrap(compress(candidates[best], options), candidates[best]);
+
+	// Verify that new stream decodes to same pixels
+	std::string check_filtered;
+	std::string check_raw;
+	if(!zlib_inflate(data, filtered_size, check_filtered) || !unfilter(check_filtered, passes, bpp, check_raw)) {
+		return {};
+	}
+	if(check_raw != raw) {
+		return {};
+	}
+
+	std::string ret(signature);
+	bool idat_written = false;
+	for(auto const& chunk : chunks) {
+		if(chunk.type == "IDAT") {
+			if(!idat_written) {
+				constexpr size_t max_chunk = size_t(1) << 30;
+				for(size_t pos = 0; pos < data.size(); pos += max_chunk) {
+					append_chunk(ret, "IDAT", std::string_view(data).substr(pos, max_chunk));
+				}
+				idat_written = true;
+			}
+		} else if(keep_chunk(chunk.type, strip)) {
+			append_chunk(ret, chunk.type, chunk.data);
+		}
+	}
+
+	if(ret.size() >= png.size()) {
+		return {};
+	}
+	return ret;
+}
@@ -0,0 +1,120 @@
+#include "provenance.hpp"
+#include "utils.hpp"
+#include "version.hpp"
+
+#include <fmt/core.h>
+
+static constexpr uint16_t marker_id = 0x7265;
+static constexpr uint16_t marker_size = 8;
+static constexpr std::string_view book_prefix = "epub-repack ";
+
+static void append2(std::string& str, uint16_t value) {
+	str.push_back(static_cast<char>(value >> 0));
+	str.push_back(static_cast<char>(value >> 8));
+}
+
+static void append4(std::string& str, uint32_t value) {
+	append2(str, static_cast<uint16_t>(value >> 0));
+	append2(str, static_cast<uint16_t>(value >> 16));
+}
+
+// Records of extra field except marker, data of marker is stored to *marker.
+// Malformed tail is kept as it is.
+static std::string split_extra(std::string_view extra, std::string_view* marker) {
+	std::string ret;
+	size_t pos = 0;
+	while(pos + 4 <= extra.size()) {
+		uint16_t id = read2(extra, pos);
+		uint16_t size = read2(extra, pos + 2);
+		if(pos + 4 + size > extra.size()) {
+			break;
+		}
+		if(id == marker_id) {
+			if(marker) {
+				*marker = extra.substr(pos + 4, size);
+			}
+		} else {
+			ret.append(extra.substr(pos, 4 + size));
+		}
+		pos += 4 + size;
+	}
+	ret.append(extra.substr(pos));
+	return ret;
+}
+
+static std::string book_line(std::string_view settings, std::vector<File> const& files) {
+	std::string entries;
+	for(auto const& file : files) {
+		LFH const& lfh = file.lfh;
+		// clang-format off
+		entries += fmt::format("{}:{}:{:08x}:{}:{}\n",
+			lfh.file_name,
+			lfh.compression_method,
+			lfh.crc32,
+			lfh.compressed_size,
+			lfh.uncompressed_size
+		);
+		// clang-format on
+	}
+	// clang-format off
+	return fmt::format("{}{} {:08x} {}",
+		book_prefix,
+		VERSION,
+		provenance_hash(settings),
+		to_hex(sha1(entries)).substr(0, 16)
+	);
+	// clang-format on
+}
+
+// Comment split to text before marker line and the line itself
+static std::pair<std::string_view, std::string_view> split_comment(std::string_view comment) {
+	size_t eol = comment.rfind('\n');
+	size_t start = eol == std::string_view::npos ? 0 : eol + 1;
+	std::string_view line = comment.substr(start);
+	if(line.substr(0, book_prefix.size()) != book_prefix) {
+		return {comment, {}};
+	}
+	return {comment.substr(0, eol == std::string_view::npos ? 0 : eol), line};
+}
+
+uint32_t provenance_hash(std::string_view settings) {
+	return read4(sha1(fmt::format("{}|{}", VERSION, settings)), 0);
+}
+
+std::string provenance_extra(std::string_view extra, uint32_t settings, uint32_t compressed_size) {
+	std::string ret = split_extra(extra, nullptr);
+	append2(ret, marker_id);
+	append2(ret, marker_size);
+	append4(ret, settings);
+	append4(ret, compressed_size);
+	return ret;
+}
+
+std::string provenance_strip(std::string_view extra) {
+	return split_extra(extra, nullptr);
+}
+
+bool provenance_entry(File const& file, uint32_t settings) {
+	std::string_view marker;
+	split_extra(file.cdfh.extra_field, &marker);
+	// clang-format off
+	return marker.size() == marker_size
+		&& read4(marker, 0) == settings
+		&& read4(marker, 4) == file.lfh.compressed_size
+		&& file.cdfh.compressed_size == file.lfh.compressed_size;
+	// clang-format on
+}
+
+std::string provenance_comment(std::string_view comment, std::string_view settings, std::vector<File> const& files) {
+	std::string ret(split_comment(comment).first);
+	if(!ret.empty()) {
+		ret += '\n';
+	}
+	ret += book_line(settings, files);
+	return ret;
+}
+
+bool provenance_book(Zip const& zip, std::string_view settings) {
+	std::string_view line = split_comment(zip.eocd.comment).second;
+	return !line.empty() && line == book_line(settings, zip.files);
+}
@@ -0,0 +1,20 @@
+#include "repacker.hpp"
+
+#include "app.hpp"
+
+#include <exception>
+
+Repacker::Repacker(std::vector<std::string> const& options, ThreadPool& pool) : app_(std::make_unique<App>()) {
+	app_->configure(options, pool);
+}
+
+Repacker::~Repacker() {
+	try {
+		app_->trim_cache();
+	} catch(std::exception const&) {
+	}
+}
+
+std::string Repacker::repack(std::string_view epub, Progress const& progress) {
+	return app_->repack(epub, progress);
+}
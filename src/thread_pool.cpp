@@ -0,0 +1,209 @@
+#include "thread_pool.hpp"
+
+#include <algorithm>
+
+namespace {
+
+// Pool and queue index of current worker thread.
+thread_local ThreadPool const* current_pool = nullptr;
+thread_local size_t current_index = 0;
+
+}  // namespace
+
+ThreadPool::ThreadPool(unsigned threads) {
+	// Last one is thread waiting for tasks
+	size_t workers = threads > 1 ? threads - 1 : 0;
+	size_t n = std::max(workers, size_t(1));
+	queues_.reserve(n);
+	for(size_t i = 0; i < n; ++i) {
+		queues_.push_back(std::make_unique<Queue>());
+	}
+
+	workers_.reserve(workers);
+	for(size_t i = 0; i < workers; ++i) {
+		workers_.emplace_back([this, i] { worker(i); });
+	}
+}
+
+ThreadPool::~ThreadPool() {
+	{
+		std::lock_guard lock(mutex_);
+		stop_ = true;
+	}
+	cv_.notify_all();
+
+	for(auto& w : workers_) {
+		w.join();
+	}
+}
+
+void ThreadPool::submit(Task task, uint64_t weight) {
+	// Tasks spawned by worker stay local, others go to least loaded queue.
+	Queue* q = nullptr;
+	if(current_pool == this) {
+		q = queues_[current_index].get();
+	} else {
+		uint64_t min_load = UINT64_MAX;
+		for(auto& queue : queues_) {
+			std::lock_guard lock(queue->mutex);
+			if(queue->load < min_load) {
+				min_load = queue->load;
+				q = queue.get();
+			}
+		}
+	}
+
+	{
+		std::lock_guard lock(q->mutex);
+		auto it = std::upper_bound(q->jobs.begin(), q->jobs.end(), weight,
+			[](uint64_t w, Job const& job) { return w > job.weight; });
+		q->jobs.insert(it, Job{std::move(task), weight});
+		q->load += weight;
+	}
+
+	{
+		std::lock_guard lock(mutex_);
+		++queued_;
+	}
+	cv_.notify_one();
+}
+
+bool ThreadPool::run_pending() {
+	Job job;
+	if(current_pool == this) {
+		if(!pop(current_index, job) && !steal(job)) {
+			return false;
+		}
+	} else if(!steal(job)) {
+		return false;
+	}
+
+	job.task();
+	return true;
+}
+
+bool ThreadPool::pop(size_t index, Job& job) {
+	Queue& q = *queues_[index];
+	{
+		std::lock_guard lock(q.mutex);
+		if(q.jobs.empty()) {
+			return false;
+		}
+		job = std::move(q.jobs.front());
+		q.jobs.pop_front();
+		q.load -= job.weight;
+	}
+
+	std::lock_guard lock(mutex_);
+	--queued_;
+	return true;
+}
+
+bool ThreadPool::steal(Job& job) {
+	// Victim is queue with heaviest task waiting; retry if it was taken meanwhile.
+	for(;;) {
+		size_t victim = queues_.size();
+		uint64_t max_weight = 0;
+		for(size_t i = 0; i < queues_.size(); ++i) {
+			Queue& q = *queues_[i];
+			std::lock_guard lock(q.mutex);
+			if(!q.jobs.empty() && (victim == queues_.size() || q.jobs.front().weight > max_weight)) {
+				victim = i;
+				max_weight = q.jobs.front().weight;
+			}
+		}
+
+		if(victim == queues_.size()) {
+			return false;
+		}
+		if(pop(victim, job)) {
+			return true;
+		}
+	}
+}
+
+bool ThreadPool::take(Job& job) {
+	return pop(current_index, job) || steal(job);
+}
+
+void ThreadPool::worker(size_t index) {
+	current_pool = this;
+	current_index = index;
+
+	for(;;) {
+		Job job;
+		if(take(job)) {
+			job.task();
+			continue;
+		}
+
+		std::unique_lock lock(mutex_);
+		cv_.wait(lock, [this] { return stop_ || queued_ > 0; });
+		if(stop_ && queued_ == 0) {
+			return;
+		}
+	}
+}
+
+TaskGroup::TaskGroup(ThreadPool& pool) : pool_(pool) {
+}
+
+TaskGroup::~TaskGroup() {
+	join();
+}
+
+void TaskGroup::run(ThreadPool::Task task, uint64_t weight) {
+	{
+		std::lock_guard lock(mutex_);
+		++pending_;
+	}
+
+	// clang-format off
+	pool_.submit([this, task = std::move(task)] {
+		std::exception_ptr error;
+		try {
+			task();
+		} catch(...) {
+			error = std::current_exception();
+		}
+
+		std::lock_guard lock(mutex_);
+		if(error && !error_) {
+			error_ = error;
+		}
+		if(--pending_ == 0) {
+			cv_.notify_all();
+		}
+	}, weight);
+	// clang-format on
+}
+
+void TaskGroup::wait() {
+	join();
+
+	std::lock_guard lock(mutex_);
+	if(error_) {
+		std::exception_ptr error = error_;
+		error_ = nullptr;
+		std::rethrow_exception(error);
+	}
+}
+
+void TaskGroup::join() {
+	for(;;) {
+		{
+			std::lock_guard lock(mutex_);
+			if(pending_ == 0) {
+				return;
+			}
+		}
+
+		if(!pool_.run_pending()) {
+			break;
+		}
+	}
+
+	// Nothing left in queues, remaining tasks are already running on workers.
+	std::unique_lock lock(mutex_);
+	cv_.wait(lock, [this] { return pending_ == 0; });
+}
@@ -1,11 +1,28 @@
 #include "utils.hpp"
 
 #include <fstream>
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <chrono>
 #include <iterator>
+#include <utility>
+#include <vector>
 
 #include <fmt/core.h>
 
 #include <zopfli.h>
+#include <libdeflate.h>
+
+#ifdef _WIN32
+#include <fcntl.h>
+#include <io.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 
 std::string read_file(std::string const& path) {
 	std::ifstream file(path, std::ios::binary);
@@ -17,9 +34,122 @@ void write_file(std::string const& path, std::string const& str) {
 	file.write(str.data(), str.size());
 }
 
+#ifdef _WIN32
+
+// No mapping on Windows, just read whole file.
+MappedFile::MappedFile(std::string const& path) : buffer_(read_file(path)) {
+	data_ = buffer_.data();
+	size_ = buffer_.size();
+}
+
+MappedFile::MappedFile(int fd) {
+	_setmode(fd, _O_BINARY);
+	read_all(fd);
+}
+
+MappedFile::~MappedFile() {
+}
+
+void MappedFile::read_all(int fd) {
+	size_t size = 0;
+	buffer_.resize(size_t(1) << 20);
+	for(;;) {
+		if(size == buffer_.size()) {
+			buffer_.resize(buffer_.size() * 2);
+		}
+		int n = _read(fd, &buffer_[size], static_cast<unsigned>(std::min(buffer_.size() - size, size_t(1) << 30)));
+		if(n < 0) {
+			throw std::runtime_error("Can't read input");
+		}
+		if(n == 0) {
+			break;
+		}
+		size += static_cast<size_t>(n);
+	}
+	buffer_.resize(size);
+	data_ = buffer_.data();
+	size_ = buffer_.size();
+}
+
+#else
+
+MappedFile::MappedFile(std::string const& path) {
+	int fd = open(path.c_str(), O_RDONLY);
+	if(fd < 0) {
+		throw std::runtime_error(fmt::format("Can't open \"{}\"", path));
+	}
+
+	struct stat st;
+	if(fstat(fd, &st) != 0) {
+		close(fd);
+		throw std::runtime_error(fmt::format("Can't stat \"{}\"", path));
+	}
+
+	size_ = static_cast<size_t>(st.st_size);
+	if(size_ > 0) {
+		void* p = mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+		if(p == MAP_FAILED) {
+			close(fd);
+			throw std::runtime_error(fmt::format("Can't map \"{}\"", path));
+		}
+		data_ = static_cast<const char*>(p);
+		mapped_ = true;
+	}
+
+	// Mapping stays valid after closing descriptor
+	close(fd);
+}
+
+// Redirected file is mapped as it is, only pipe has to be copied
+MappedFile::MappedFile(int fd) {
+	struct stat st;
+	if(fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0 && lseek(fd, 0, SEEK_CUR) == 0) {
+		void* p = mmap(nullptr, static_cast<size_t>(st.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+		if(p != MAP_FAILED) {
+			data_ = static_cast<const char*>(p);
+			size_ = static_cast<size_t>(st.st_size);
+			mapped_ = true;
+			return;
+		}
+	}
+	read_all(fd);
+}
+
+MappedFile::~MappedFile() {
+	if(mapped_) {
+		munmap(const_cast<char*>(data_), size_);
+	}
+}
+
+// Buffer grows geometrically and data is read right into it
+void MappedFile::read_all(int fd) {
+	size_t size = 0;
+	buffer_.resize(size_t(1) << 20);
+	for(;;) {
+		if(size == buffer_.size()) {
+			buffer_.resize(buffer_.size() * 2);
+		}
+		ssize_t n = read(fd, &buffer_[size], buffer_.size() - size);
+		if(n < 0) {
+			if(errno == EINTR) {
+				continue;
+			}
+			throw std::runtime_error("Can't read input");
+		}
+		if(n == 0) {
+			break;
+		}
+		size += static_cast<size_t>(n);
+	}
+	buffer_.resize(size);
+	data_ = buffer_.data();
+	size_ = buffer_.size();
+}
+
+#endif
 // clang-format off
 
-uint32_t read4(std::string const& str, size_t offset) {
+uint32_t read4(std::string_view str, size_t offset) {
 	return 
 		(uint32_t(uint8_t(str[offset+0])) << 0)  |
 		(uint32_t(uint8_t(str[offset+1])) << 8)  |
@@ -27,37 +157,90 @@ uint32_t read4(std::string const& str, size_t offset) {
 		(uint32_t(uint8_t(str[offset+3])) << 24);
 }
 
-void write4(std::ofstream& ofs, uint32_t value) {
-	const uint8_t v[] = {
-		static_cast<uint8_t>(value >> 0),
-		static_cast<uint8_t>(value >> 8),
-		static_cast<uint8_t>(value >> 16),
-		static_cast<uint8_t>(value >> 24),
-	};
-	//fmt::print(ofs, "{}{}{}{}", char(v[0]), char(v[1]), char(v[2]), char(v[3]));
-	ofs.write(reinterpret_cast<const char*>(v), 4);
-}
-
-uint16_t read2(std::string const& str, size_t offset) {
+uint16_t read2(std::string_view str, size_t offset) {
 	return 
 		(uint16_t(uint8_t(str[offset+0])) << 0) |
 		(uint16_t(uint8_t(str[offset+1])) << 8);
 }
 
-void write2(std::ofstream& ofs, uint16_t value) {
-	const uint8_t v[] = {
-		static_cast<uint8_t>(value >> 0),
-		static_cast<uint8_t>(value >> 8),
-	};
-	ofs.write(reinterpret_cast<const char*>(v), 2);
+// clang-format on
+
+// Not declared in zopfli.h but exported by library,
+// see zopfli/blocksplitter.h and zopfli/deflate.h
+extern "C" {
+void ZopfliBlockSplit(const ZopfliOptions* options,
+	const unsigned char* in,
+	size_t instart,
+	size_t inend,
+	size_t maxblocks,
+	size_t** splitpoints,
+	size_t* npoints);
+void ZopfliDeflatePart(const ZopfliOptions* options,
+	int btype,
+	int final,
+	const unsigned char* in,
+	size_t instart,
+	size_t inend,
+	unsigned char* bp,
+	unsigned char** out,
+	size_t* outsize);
 }
 
-// clang-format on
+static void init_options(ZopfliOptions& zo, CompressOptions const& options) {
+	ZopfliInitOptions(&zo);
+	zo.numiterations = options.iterations;
+	zo.blocksplittingmax = options.block_splitting_max;
+}
+
+std::string_view method_name(Method method) {
+	switch(method) {
+		case Method::Zopfli:
+			return "zopfli";
+		case Method::Libdeflate:
+			return "libdeflate";
+		case Method::Store:
+			return "store";
+	}
+	return "unknown";
+}
+
+std::string compress_id(CompressOptions const& options) {
+	if(options.method == Method::Libdeflate) {
+		return fmt::format("libdeflate-{}", options.level);
+	}
+	if(options.method == Method::Store) {
+		return "store";
+	}
 
-std::string compress(std::string_view str) {
 	ZopfliOptions zo;
-	ZopfliInitOptions(&zo);
-	zo.numiterations = 16;
+	init_options(zo, options);
+	// clang-format off
+	std::string id = fmt::format("zopfli-{}:{}:{}:{}",
+		zo.numiterations,
+		zo.blocksplitting,
+		zo.blocksplittinglast,
+		zo.blocksplittingmax
+	);
+	// clang-format on
+	if(options.min_gain > 0) {
+		id += fmt::format(":adaptive-{}:{}", options.min_gain, options.time_limit);
+	}
+	if(options.race_gain > 0) {
+		id += fmt::format(":race-{}", options.race_gain);
+	}
+	return id;
+}
+
+std::string compress(std::string_view str, CompressOptions const& options) {
+	if(options.method == Method::Libdeflate) {
+		return compress_libdeflate(str, options.level);
+	}
+	if(options.method == Method::Store) {
+		return compress_libdeflate(str, 0);
+	}
+
+	ZopfliOptions zo;
+	init_options(zo, options);
 
 	const unsigned char* in = reinterpret_cast<const unsigned char*>(str.data());
 	size_t out_size = 0;
@@ -74,19 +257,276 @@ std::string compress(std::string_view str) {
 	return ret;
 }
 
+std::string compress_libdeflate(std::string_view str, int level) {
+	libdeflate_compressor* c = libdeflate_alloc_compressor(level);
+	if(!c) {
+		throw std::runtime_error(fmt::format("Invalid libdeflate level: {}", level));
+	}
+
+	std::string ret(libdeflate_deflate_compress_bound(c, str.size()), '\0');
+	size_t size = libdeflate_deflate_compress(c, str.data(), str.size(), ret.data(), ret.size());
+	libdeflate_free_compressor(c);
+
+	ret.resize(size);
+	return ret;
+}
+
+std::string compress_adaptive(std::string_view str, CompressOptions const& options, int* iterations) {
+	using clock = std::chrono::steady_clock;
+	auto start = clock::now();
+
+	// Zopfli can't continue previous run, so every stage starts over.
+	// Stages double up to the fixed count, so while gains continue total
+	// cost grows to about twice of it. Time is saved by stopping on small
+	// gain (--adaptive) or on time limit (--entry-time).
+	CompressOptions stage = options;
+	stage.iterations = std::min(5, options.iterations);
+
+	std::string best = compress(str, stage);
+	int spent = stage.iterations;
+	auto last_size = best.size();
+	auto last_time = clock::now() - start;
+
+	while(stage.iterations < options.iterations) {
+		int prev = stage.iterations;
+		stage.iterations = std::min(prev * 2, options.iterations);
+
+		if(options.time_limit > 0) {
+			auto expected = last_time * stage.iterations / prev;
+			if(std::chrono::duration<double>(clock::now() - start + expected).count() > options.time_limit) {
+				break;
+			}
+		}
+
+		auto t = clock::now();
+		std::string out = compress(str, stage);
+		last_time = clock::now() - t;
+		spent += stage.iterations;
+
+		auto gain = static_cast<int64_t>(last_size) - static_cast<int64_t>(out.size());
+		last_size = out.size();
+		if(out.size() < best.size()) {
+			best = std::move(out);
+		}
+		if(gain < static_cast<int64_t>(options.min_gain) * (stage.iterations - prev)) {
+			break;
+		}
+	}
+
+	if(iterations) {
+		*iterations = spent;
+	}
+	return best;
+}
+
+std::string compress_split(std::string_view str, CompressOptions const& options, ThreadPool& pool, size_t* parts) {
+	ZopfliOptions zo;
+	init_options(zo, options);
+
+	const unsigned char* in = reinterpret_cast<const unsigned char*>(str.data());
+
+	size_t* split_points = nullptr;
+	size_t n_points = 0;
+	// clang-format off
+	ZopfliBlockSplit(&zo,
+		in, 0, str.size(),
+		static_cast<size_t>(zo.blocksplittingmax),
+		&split_points, &n_points
+	);
+	// clang-format on
+
+	std::vector<size_t> bounds;
+	bounds.push_back(0);
+	bounds.insert(bounds.end(), split_points, split_points + n_points);
+	bounds.push_back(str.size());
+	free(split_points);
+
+	// Every part is compressed with all preceding input as its dictionary,
+	// so back references may cross part boundaries as in single stream.
+	// Non-final parts end with empty stored block (sync flush) to pad them
+	// to byte boundary. Stored blocks are aligned relative to start of part,
+	// so parts can't be just shifted into place at arbitrary bit position.
+	std::vector<std::string> deflate_parts(bounds.size() - 1);
+	{
+		TaskGroup group(pool);
+		for(size_t i = 0; i < deflate_parts.size(); ++i) {
+			// clang-format off
+			group.run([&, i] {
+				unsigned char bp = 0;
+				unsigned char* out = nullptr;
+				size_t out_size = 0;
+				bool final = i + 1 == deflate_parts.size();
+				ZopfliDeflatePart(&zo, 2, final,
+					in, bounds[i], bounds[i + 1],
+					&bp, &out, &out_size
+				);
+
+				std::string& part = deflate_parts[i];
+				part.assign(reinterpret_cast<char*>(out), out_size);
+				free(out);
+
+				if(!final) {
+					// BFINAL=0, BTYPE=00 fits into current byte when at least 3 bits are free
+					if(bp == 0 || bp > 5) {
+						part.push_back('\0');
+					}
+					part.append("\x00\x00\xff\xff", 4);
+				}
+			}, bounds[i + 1] - bounds[i]);
+			// clang-format on
+		}
+		group.wait();
+	}
+
+	if(parts) {
+		*parts = deflate_parts.size();
+	}
+
+	std::string ret;
+	for(auto const& part : deflate_parts) {
+		ret.append(part);
+	}
+	return ret;
+}
+
+std::string_view mime_type(std::string_view file_name) {
+	// clang-format off
+	static constexpr std::pair<std::string_view, std::string_view> types[] = {
+		{"xhtml", "application/xhtml+xml"},
+		{"html",  "text/html"},
+		{"htm",   "text/html"},
+		{"css",   "text/css"},
+		{"opf",   "application/oebps-package+xml"},
+		{"ncx",   "application/x-dtbncx+xml"},
+		{"xml",   "application/xml"},
+		{"smil",  "application/smil+xml"},
+		{"js",    "application/javascript"},
+		{"txt",   "text/plain"},
+		{"svg",   "image/svg+xml"},
+		{"jpg",   "image/jpeg"},
+		{"jpeg",  "image/jpeg"},
+		{"png",   "image/png"},
+		{"gif",   "image/gif"},
+		{"webp",  "image/webp"},
+		{"ttf",   "font/ttf"},
+		{"otf",   "font/otf"},
+		{"woff",  "font/woff"},
+		{"woff2", "font/woff2"},
+		{"mp3",   "audio/mpeg"},
+		{"m4a",   "audio/mp4"},
+		{"mp4",   "video/mp4"},
+	};
+	// clang-format on
+
+	size_t dot = file_name.rfind('.');
+	if(dot != std::string_view::npos && file_name.find('/', dot) == std::string_view::npos) {
+		std::string_view ext = file_name.substr(dot + 1);
+		for(auto const& [e, type] : types) {
+			// clang-format off
+			bool match = e.size() == ext.size() && std::equal(e.begin(), e.end(), ext.begin(),
+				[](char a, char b) { return a == std::tolower(static_cast<unsigned char>(b)); });
+			// clang-format on
+			if(match) {
+				return type;
+			}
+		}
+	}
+	return "application/octet-stream";
+}
+
+// libdeflate picks fastest implementation for CPU at runtime
+// (PCLMULQDQ/VPCLMULQDQ folding on x86, crc32 instructions on ARM,
+// slicing-by-8 otherwise).
 uint32_t crc32(const std::string_view str) {
-	uint32_t crc = ~uint32_t{0};
+	return libdeflate_crc32(0, str.data(), str.size());
+}
+
+namespace {
+
+inline uint32_t rotl(uint32_t x, int n) {
+	return (x << n) | (x >> (32 - n));
+}
+
+void sha1_block(uint32_t h[5], const uint8_t* p) {
+	uint32_t w[80];
+	for(int i = 0; i < 16; ++i) {
+		w[i] = (uint32_t(p[i * 4]) << 24) | (uint32_t(p[i * 4 + 1]) << 16) | (uint32_t(p[i * 4 + 2]) << 8) |
+			uint32_t(p[i * 4 + 3]);
+	}
+	for(int i = 16; i < 80; ++i) {
+		w[i] = rotl(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+	}
+
+	uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4];
+	for(int i = 0; i < 80; ++i) {
+		uint32_t f, k;
+		if(i < 20) {
+			f = (b & c) | (~b & d);
+			k = 0x5A827999;
+		} else if(i < 40) {
+			f = b ^ c ^ d;
+			k = 0x6ED9EBA1;
+		} else if(i < 60) {
+			f = (b & c) | (b & d) | (c & d);
+			k = 0x8F1BBCDC;
+		} else {
+			f = b ^ c ^ d;
+			k = 0xCA62C1D6;
+		}
+		uint32_t t = rotl(a, 5) + f + e + k + w[i];
+		e = d;
+		d = c;
+		c = rotl(b, 30);
+		b = a;
+		a = t;
+	}
+
+	h[0] += a;
+	h[1] += b;
+	h[2] += c;
+	h[3] += d;
+	h[4] += e;
+}
+
+}  // namespace
+
+std::string sha1(std::string_view str) {
+	uint32_t h[5] = {0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0};
 
 	const uint8_t* p = reinterpret_cast<const uint8_t*>(str.data());
 	size_t len = str.size();
-	while(len-- != 0) {
-		crc ^= *p++;
+	for(; len >= 64; len -= 64, p += 64) {
+		sha1_block(h, p);
+	}
 
-		for(int i = 0; i < 8; ++i) {
-			crc = (crc >> 1) ^ (-int32_t(crc & 1) & 0xEDB88320);
-		}
+	// padding: 0x80, zeros, message length in bits (big endian)
+	uint8_t tail[128] = {};
+	std::copy(p, p + len, tail);
+	tail[len] = 0x80;
+	size_t tail_size = len < 56 ? 64 : 128;
+	uint64_t bits = uint64_t(str.size()) * 8;
+	for(int i = 0; i < 8; ++i) {
+		tail[tail_size - 1 - size_t(i)] = static_cast<uint8_t>(bits >> (i * 8));
+	}
+	sha1_block(h, tail);
+	if(tail_size == 128) {
+		sha1_block(h, tail + 64);
 	}
 
-	return ~crc;
+	std::string ret(20, '\0');
+	for(size_t i = 0; i < 20; ++i) {
+		ret[i] = static_cast<char>(h[i / 4] >> (24 - (i % 4) * 8));
+	}
+	return ret;
 }
 
+std::string to_hex(std::string_view str) {
+	static const char digits[] = "0123456789abcdef";
+	std::string ret;
+	ret.reserve(str.size() * 2);
+	for(char c : str) {
+		ret.push_back(digits[uint8_t(c) >> 4]);
+		ret.push_back(digits[uint8_t(c) & 15]);
+	}
+	return ret;
+}
@@ -2,17 +2,24 @@
 
 #include <fmt/core.h>
 
+#include <algorithm>
+#include <cctype>
 #include <exception>
+#include <iterator>
+#include <map>
+#include <set>
+#include <string_view>
+#include <vector>
 
 class StrWriter : public pugi::xml_writer {
 public:
 	void write(const void* data, size_t size) override {
-		output.append(std::string(static_cast<const char*>(data), size));
+		output.append(static_cast<const char*>(data), size);
 	}
 
-	std::string str(pugi::xml_document const& doc) {
-		doc.print(*this);
-		return output;
+	std::string str(pugi::xml_document const& doc, unsigned int flags = pugi::format_default) {
+		doc.print(*this, "\t", flags);
+		return std::move(output);
 	}
 
 private:
@@ -23,8 +30,257 @@ inline std::string doc_to_string(pugi::xml_document const& doc) {
 	return StrWriter().str(doc);
 }
 
-XML::XML(std::string_view const& xml) {
-	pugi::xml_parse_result result = doc.load_buffer(xml.data(), xml.size());
+// clang-format off
+static constexpr std::string_view block_elements[] = {
+	"address", "article", "aside", "blockquote", "body", "caption", "dd", "div", "dl", "dt",
+	"fieldset", "figcaption", "figure", "footer", "form", "h1", "h2", "h3", "h4", "h5", "h6",
+	"header", "hr", "li", "main", "nav", "ol", "p", "section", "table", "tbody", "td", "tfoot",
+	"th", "thead", "tr", "ul"
+};
+
+// Written as <br/>, other empty elements as <p></p> for readers parsing XHTML as HTML
+static constexpr std::string_view void_elements[] = {
+	"area", "base", "br", "col", "embed", "hr", "img", "input", "link", "meta", "param",
+	"source", "track", "wbr"
+};
+// clang-format on
+
+static bool is_one_of(pugi::xml_node node, std::string_view const* names, size_t count) {
+	return std::find(names, names + count, std::string_view(node.name())) != names + count;
+}
+
+static bool is_block(pugi::xml_node node) {
+	return is_one_of(node, block_elements, std::size(block_elements));
+}
+
+static bool is_space(char c) {
+	return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+}
+
+// SVG and MathML have own rules for whitespace and empty elements
+static bool is_foreign(pugi::xml_node node) {
+	std::string_view name = node.name();
+	return name == "svg" || name == "math";
+}
+
+// Whitespace in these is rendered or is part of script
+static bool keeps_text(pugi::xml_node node) {
+	std::string_view name = node.name();
+	return name == "pre" || name == "textarea" || name == "script" || name == "style" || is_foreign(node) ||
+		std::string_view(node.attribute("xml:space").value()) == "preserve";
+}
+
+// Nearest sibling that stays in document
+static pugi::xml_node sibling(pugi::xml_node node, bool next) {
+	do {
+		node = next ? node.next_sibling() : node.previous_sibling();
+	} while(node && node.type() == pugi::node_comment);
+	return node;
+}
+
+// Whitespace only text between block elements (or at start or end of block)
+// isn't rendered
+static bool between_blocks(pugi::xml_node text) {
+	auto block_side = [&](pugi::xml_node node) {
+		return node ? node.type() == pugi::node_element && is_block(node) : is_block(text.parent());
+	};
+	return block_side(sibling(text, false)) && block_side(sibling(text, true));
+}
+
+static void minify_node(pugi::xml_node node, bool xhtml, bool collapse_spaces, bool keep_text) {
+	std::string_view parent = node.name();
+	for(pugi::xml_node child = node.first_child(); child;) {
+		pugi::xml_node next = child.next_sibling();
+		switch(child.type()) {
+			case pugi::node_comment:
+				if(!keep_text) {
+					node.remove_child(child);
+				}
+				break;
+			case pugi::node_pcdata: {
+				if(keep_text) {
+					break;
+				}
+				std::string_view text = child.value();
+				bool blank = std::all_of(text.begin(), text.end(), is_space);
+				if(!xhtml) {
+					// Data formats (OPF, NCX) have no mixed content
+					if(blank && (sibling(child, false) || sibling(child, true))) {
+						node.remove_child(child);
+					}
+				} else if(blank && (parent == "html" || parent == "head" || (collapse_spaces && between_blocks(child)))) {
+					node.remove_child(child);
+				} else if(collapse_spaces) {
+					std::string collapsed;
+					for(char c : text) {
+						if(!is_space(c)) {
+							collapsed += c;
+						} else if(collapsed.empty() || collapsed.back() != ' ') {
+							collapsed += ' ';
+						}
+					}
+					if(collapsed.size() < text.size()) {
+						child.set_value(collapsed.c_str());
+					}
+				}
+				break;
+			}
+			case pugi::node_element:
+				minify_node(child, xhtml, collapse_spaces, keep_text || keeps_text(child));
+				break;
+			default:
+				break;
+		}
+		child = next;
+	}
+}
+
+// Raw output writes attribute values in double quotes as they were read
+static bool quotable(pugi::xml_node node) {
+	for(auto attribute : node.attributes()) {
+		if(std::string_view(attribute.value()).find('"') != std::string_view::npos) {
+			return false;
+		}
+	}
+	for(auto child : node.children()) {
+		if(child.type() == pugi::node_element && !quotable(child)) {
+			return false;
+		}
+	}
+	return true;
+}
+
+static void keep_open_tags(pugi::xml_node node) {
+	for(auto child : node.children()) {
+		if(child.type() != pugi::node_element || is_foreign(child)) {
+			continue;
+		}
+		keep_open_tags(child);
+		if(!child.first_child() && !is_one_of(child, void_elements, std::size(void_elements))) {
+			child.append_child(pugi::node_pcdata);
+		}
+	}
+}
+
+// Name of element without namespace prefix
+static std::string_view local_name(pugi::xml_node node) {
+	std::string_view name = node.name();
+	return name.substr(name.find(':') + 1);
+}
+
+// Directory of path in zip, with trailing slash
+static std::string_view dir_of(std::string_view path) {
+	auto slash = path.rfind('/');
+	return slash == std::string_view::npos ? std::string_view() : path.substr(0, slash + 1);
+}
+
+static std::vector<std::string_view> split_path(std::string_view path) {
+	std::vector<std::string_view> ret;
+	size_t pos = 0;
+	while(pos < path.size()) {
+		size_t end = std::min(path.find('/', pos), path.size());
+		ret.push_back(path.substr(pos, end - pos));
+		pos = end + 1;
+	}
+	return ret;
+}
+
+static std::string percent_decode(std::string_view str) {
+	std::string ret;
+	for(size_t i = 0; i < str.size(); ++i) {
+		if(str[i] == '%' && i + 2 < str.size() && std::isxdigit(static_cast<unsigned char>(str[i + 1])) &&
+			std::isxdigit(static_cast<unsigned char>(str[i + 2]))) {
+			ret += static_cast<char>(std::stoi(std::string(str.substr(i + 1, 2)), nullptr, 16));
+			i += 2;
+		} else {
+			ret += str[i];
+		}
+	}
+	return ret;
+}
+
+// Path in zip of relative reference from directory, empty if reference is
+// absolute URL or leaves archive
+static std::string resolve(std::string_view dir, std::string_view ref) {
+	if(ref.empty() || ref[0] == '/' || ref.find(':') != std::string_view::npos) {
+		return {};
+	}
+	std::string decoded = percent_decode(ref);
+	std::vector<std::string_view> parts;
+	for(auto const& list : {split_path(dir), split_path(decoded)}) {
+		for(auto part : list) {
+			if(part == "..") {
+				if(parts.empty()) {
+					return {};
+				}
+				parts.pop_back();
+			} else if(!part.empty() && part != ".") {
+				parts.push_back(part);
+			}
+		}
+	}
+	std::string ret;
+	for(auto part : parts) {
+		ret += ret.empty() ? "" : "/";
+		ret += part;
+	}
+	return ret;
+}
+
+// Relative reference from directory to path in zip
+static std::string relative(std::string_view dir, std::string_view path) {
+	auto from = split_path(dir);
+	auto to = split_path(path);
+	size_t common = 0;
+	while(common < from.size() && common + 1 < to.size() && from[common] == to[common]) {
+		++common;
+	}
+	std::string ret;
+	for(size_t i = common; i < from.size(); ++i) {
+		ret += "../";
+	}
+	for(size_t i = common; i < to.size(); ++i) {
+		ret += to[i];
+		ret += i + 1 < to.size() ? "/" : "";
+	}
+	return ret;
+}
+
+// Rewrite attribute holding reference, fragment or query is kept.
+// Returns path of original target if it was rewritten.
+static std::string rewrite_reference(pugi::xml_attribute attribute, std::string_view dir, std::map<std::string, std::string> const& targets) {
+	std::string_view value = attribute.value();
+	size_t end = std::min(value.find_first_of("#?"), value.size());
+	auto target = targets.find(resolve(dir, value.substr(0, end)));
+	if(target == targets.end()) {
+		return {};
+	}
+	std::string ref = relative(dir, target->second);
+	ref += value.substr(end);
+	attribute.set_value(ref.c_str());
+	return target->first;
+}
+
+static void rewrite_node(pugi::xml_node node, std::string_view dir, std::map<std::string, std::string> const& targets, std::map<std::string, size_t>& counts) {
+	static constexpr std::string_view reference_attributes[] = {"src", "href", "xlink:href", "poster", "data"};
+	for(auto attribute : node.attributes()) {
+		std::string_view name = attribute.name();
+		if(std::find(std::begin(reference_attributes), std::end(reference_attributes), name) != std::end(reference_attributes)) {
+			std::string path = rewrite_reference(attribute, dir, targets);
+			if(!path.empty()) {
+				++counts[path];
+			}
+		}
+	}
+	for(auto child : node.children()) {
+		if(child.type() == pugi::node_element) {
+			rewrite_node(child, dir, targets, counts);
+		}
+	}
+}
+
+XML::XML(std::string_view const& xml, unsigned int options) {
+	pugi::xml_parse_result result = doc.load_buffer(xml.data(), xml.size(), options);
 	if(!result) {
 		throw std::runtime_error(fmt::format("XML: {}", result.description()));
 	}
@@ -42,37 +298,177 @@ std::string XML::get_rootfile() {
 	return rootfile.attribute("full-path").value();
 }
 
-std::string XML::fix_metadata() {
-	auto metadata = doc.child("package").child("metadata");
-	auto series = metadata.find_child_by_attribute("meta", "name", "calibre:series");
-	auto index = metadata.find_child_by_attribute("meta", "name", "calibre:series_index");
+std::vector<std::string> XML::get_identifiers() {
+	auto package = doc.child("package");
+	std::string_view unique = package.attribute("unique-identifier").value();
+	std::vector<std::string> identifiers;
+	for(auto node : package.child("metadata").children()) {
+		if(local_name(node) != "identifier") {
+			continue;
+		}
+		std::string value = node.text().get();
+		auto position = unique == node.attribute("id").value() ? identifiers.begin() : identifiers.end();
+		identifiers.insert(position, value);
+	}
+	return identifiers;
+}
 
-	// Make sure that attributes starts with "name" and "content" and with that order.
-	auto fix_name_content = [](pugi::xml_node& node) {
-		std::string name = node.attribute("name").value();
-		std::string content = node.attribute("content").value();
-		node.remove_attribute("name");
-		node.remove_attribute("content");
-		node.prepend_attribute("content").set_value(content.c_str());
-		node.prepend_attribute("name").set_value(name.c_str());
+std::map<std::string, std::string> XML::get_encryption() {
+	// Elements are in XML Encryption namespace with any prefix
+	std::map<std::string, std::string> encryption;
+	auto visit = [&](auto& self, pugi::xml_node node) -> void {
+		for(auto child : node.children()) {
+			if(local_name(child) != "EncryptedData") {
+				self(self, child);
+				continue;
+			}
+			std::string algorithm;
+			std::string uri;
+			for(auto part : child.children()) {
+				if(local_name(part) == "EncryptionMethod") {
+					algorithm = part.attribute("Algorithm").value();
+				} else if(local_name(part) == "CipherData") {
+					for(auto reference : part.children()) {
+						if(local_name(reference) == "CipherReference") {
+							uri = percent_decode(reference.attribute("URI").value());
+						}
+					}
+				}
+			}
+			if(!uri.empty()) {
+				encryption[uri] = algorithm;
+			}
+		}
 	};
+	visit(visit, doc);
+	return encryption;
+}
 
-	// normalize all <meta> tags
-	for(auto& meta : metadata.children("meta")) {
-		fix_name_content(meta);
+std::string XML::text() {
+	std::string text;
+	auto visit = [&](auto& self, pugi::xml_node node) -> void {
+		for(auto attribute : node.attributes()) {
+			text += attribute.value();
+			text += ' ';
+		}
+		for(auto child : node.children()) {
+			if(child.type() == pugi::node_pcdata || child.type() == pugi::node_cdata) {
+				text += child.value();
+			} else if(child.type() == pugi::node_element) {
+				self(self, child);
+			}
+		}
+	};
+	visit(visit, doc);
+	return text;
+}
+
+std::string XML::to_raw_string(bool xhtml) {
+	// Text is written without escaping as it was read, it's in UTF-8 only
+	for(auto node : doc.children()) {
+		if(node.type() == pugi::node_declaration) {
+			std::string encoding = node.attribute("encoding").value();
+			std::transform(encoding.begin(), encoding.end(), encoding.begin(), [](unsigned char c) { return std::tolower(c); });
+			if(!encoding.empty() && encoding != "utf-8" && encoding != "us-ascii") {
+				return {};
+			}
+		}
 	}
 
-	// Make <meta> tags with names calibre:series and calibre:series_index lats two in <metadata>.
-	// Also make it in that order.
-	if(series) {
-		// fix_name_content(series);
-		metadata.append_move(series);
+	if(!quotable(doc)) {
+		return {};
 	}
-	if(index) {
-		// fix_name_content(index);
-		metadata.append_move(index);
+	if(xhtml) {
+		keep_open_tags(doc);
 	}
+	return StrWriter().str(doc, pugi::format_raw | pugi::format_no_escapes);
+}
 
-	return doc_to_string(doc);
+std::string XML::minify(bool xhtml, bool collapse_spaces) {
+	for(pugi::xml_node node = doc.first_child(); node;) {
+		pugi::xml_node next = node.next_sibling();
+		if(node.type() == pugi::node_comment || node.type() == pugi::node_pcdata) {
+			doc.remove_child(node);
+		} else if(node.type() == pugi::node_element) {
+			minify_node(node, xhtml, collapse_spaces, keeps_text(node));
+		}
+		node = next;
+	}
+	return to_raw_string(xhtml);
 }
 
+std::map<std::string, size_t> XML::rewrite_references(std::string_view path, std::map<std::string, std::string> const& targets) {
+	std::map<std::string, size_t> counts;
+	rewrite_node(doc, dir_of(path), targets, counts);
+	return counts;
+}
+
+std::set<std::string> XML::remove_manifest_copies(std::string_view path, std::map<std::string, std::string> const& targets) {
+	std::string_view dir = dir_of(path);
+	auto package = doc.child("package");
+	auto manifest = package.child("manifest");
+
+	std::map<std::string, pugi::xml_node> items;
+	for(auto item : manifest.children("item")) {
+		items[resolve(dir, item.attribute("href").value())] = item;
+	}
+	std::set<std::string> spine;
+	for(auto itemref : package.child("spine").children("itemref")) {
+		spine.insert(itemref.attribute("idref").value());
+	}
+
+	// Removed item id to id of kept copy
+	std::map<std::string, std::string> ids;
+	std::set<std::string> removed;
+	for(auto const& [copy, target] : targets) {
+		auto item = items.find(copy);
+		auto kept = items.find(target);
+		if(item == items.end() || kept == items.end() || spine.count(item->second.attribute("id").value())) {
+			continue;
+		}
+
+		// Kept item takes over properties like cover-image
+		std::string properties = kept->second.attribute("properties").value();
+		std::string_view moved = item->second.attribute("properties").value();
+		if(!moved.empty() && (" " + properties + " ").find(" " + std::string(moved) + " ") == std::string::npos) {
+			properties += properties.empty() ? "" : " ";
+			properties += moved;
+			auto attribute = kept->second.attribute("properties");
+			(attribute ? attribute : kept->second.append_attribute("properties")).set_value(properties.c_str());
+		}
+
+		ids[item->second.attribute("id").value()] = kept->second.attribute("id").value();
+		removed.insert(copy);
+		manifest.remove_child(item->second);
+	}
+
+	// References to removed items by id (fallback, media-overlay, cover meta,
+	// refines) or by path (guide)
+	std::map<std::string, size_t> counts;
+	std::map<std::string, std::string> removed_targets;
+	for(auto const& copy : removed) {
+		removed_targets[copy] = targets.at(copy);
+	}
+	auto rewrite = [&](auto& self, pugi::xml_node node) -> void {
+		for(auto attribute : node.attributes()) {
+			std::string_view name = attribute.name();
+			std::string value = attribute.value();
+			bool refines = name == "refines" && !value.empty() && value[0] == '#';
+			auto id = ids.find(refines ? value.substr(1) : value);
+			bool meta_cover = name == "content" && std::string_view(node.attribute("name").value()) == "cover";
+			if(id != ids.end() && (name == "fallback" || name == "media-overlay" || refines || meta_cover)) {
+				attribute.set_value(((refines ? "#" : "") + id->second).c_str());
+			} else if(name == "href") {
+				rewrite_reference(attribute, dir, removed_targets);
+			}
+		}
+		for(auto child : node.children()) {
+			if(child.type() == pugi::node_element) {
+				self(self, child);
+			}
+		}
+	};
+	rewrite(rewrite, package);
+
+	return removed;
+}
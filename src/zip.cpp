@@ -8,7 +8,28 @@
 
 #include <libdeflate.h>
 
-LFH::LFH(std::string const& str, size_t offset) :
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+
+#include <fcntl.h>
+
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <sys/uio.h>
+#include <unistd.h>
+#endif
+
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
+LFH::LFH(std::string_view str, size_t offset) :
 	signature(read4(str, offset + 0)),
 	version(read2(str, offset + 4)),
 
@@ -22,9 +43,9 @@ LFH::LFH(std::string const& str, size_t offset) :
 	file_name_length(read2(str, offset + 26)),
 	extra_field_length(read2(str, offset + 28)),
 
-	file_name(&str[offset + 30], file_name_length),
-	extra_field(&str[offset + 30 + file_name_length], extra_field_length),
-	data(&str[offset + 30 + file_name_length + extra_field_length], compressed_size) {
+	file_name(str.substr(offset + 30, file_name_length)),
+	extra_field(str.substr(offset + 30 + file_name_length, extra_field_length)),
+	data(str.substr(offset + 30 + file_name_length + extra_field_length, compressed_size)) {
 }
 
 void LFH::print() {
@@ -48,7 +69,7 @@ void LFH::print() {
 	fmt::print(" - data({}): {}\n", data.size(), "...");
 }
 
-CDFH::CDFH(std::string const& str, size_t offset) :
+CDFH::CDFH(std::string_view str, size_t offset) :
 	signature(read4(str, offset + 0)),
 	version_made_by(read2(str, offset + 4)),
 	version_needed(read2(str, offset + 6)),
@@ -69,9 +90,9 @@ CDFH::CDFH(std::string const& str, size_t offset) :
 	external_file_attributes(read4(str, offset + 38)),
 	local_file_header_offset(read4(str, offset + 42)),
 
-	file_name(&str[offset + 46], file_name_length),
-	extra_field(&str[offset + 46 + file_name_length], extra_field_length),
-	file_comment(&str[offset + 46 + file_name_length + extra_field_length], file_comment_length) {
+	file_name(str.substr(offset + 46, file_name_length)),
+	extra_field(str.substr(offset + 46 + file_name_length, extra_field_length)),
+	file_comment(str.substr(offset + 46 + file_name_length + extra_field_length, file_comment_length)) {
 }
 
 void CDFH::print() {
@@ -101,7 +122,7 @@ void CDFH::print() {
 	fmt::print(" - file comment({}): {}\n", file_comment.size(), file_comment);
 }
 
-EOCD::EOCD(std::string const& str, size_t offset) :
+EOCD::EOCD(std::string_view str, size_t offset) :
 	signature(read4(str, offset + 0)),
 	number_of_this_disk(read2(str, offset + 4)),
 	central_directory_disk_no(read2(str, offset + 6)),
@@ -111,7 +132,7 @@ EOCD::EOCD(std::string const& str, size_t offset) :
 	central_directory_offset(read4(str, offset + 16)),
 	comment_length(read2(str, offset + 20)),
 
-	comment(&str[offset + 22], comment_length) {
+	comment(str.substr(offset + 22, comment_length)) {
 }
 
 void EOCD::print() {
@@ -128,10 +149,22 @@ void EOCD::print() {
 	fmt::print(" - comment({}): {}\n", comment.size(), comment);
 }
 
-Zip::Zip(std::string const& path) {
-	content = read_file(path);
+Zip::Zip(std::string const& path) : Zip(std::make_unique<MappedFile>(path), path) {
+}
 
+Zip::Zip(std::string_view data, std::string const& name) : content(data) {
+	read(name);
+}
+
+Zip::Zip(std::unique_ptr<MappedFile> file, std::string const& name) : mapping(std::move(file)), content(mapping->data()) {
+	read(name);
+}
+
+void Zip::read(std::string const& name) {
 	size_t eocd_pos = content.rfind("PK\05\06");
+	if(eocd_pos == std::string_view::npos || content.size() - eocd_pos < 22) {
+		throw std::runtime_error(fmt::format("Not a zip file: \"{}\"", name));
+	}
 	eocd = EOCD(content, eocd_pos);
 
 	size_t cdfh_pos = eocd.central_directory_offset;
@@ -140,28 +173,11 @@ Zip::Zip(std::string const& path) {
 		CDFH cdfh(content, cdfh_pos);
 		LFH lfh(content, cdfh.local_file_header_offset);
 
-		size_t file_content_pos = cdfh.local_file_header_offset + 30 + lfh.file_name_length + lfh.extra_field_length;
-
 		File file;
 		file.cdfh = cdfh;
 		file.lfh = lfh;
 
-		if(lfh.compression_method == 0) {
-			file.content = content.substr(file_content_pos, lfh.uncompressed_size);
-		} else if(lfh.compression_method == 8) {
-			file.content = std::string(lfh.uncompressed_size, '\0');
-
-			auto d = libdeflate_alloc_decompressor();
-			size_t ret;
-			// clang-format off
-			libdeflate_deflate_decompress(d,
-				content.data() + file_content_pos, lfh.compressed_size,
-				file.content.data(), file.content.size(),
-				&ret
-			);
-			// clang-format on
-			libdeflate_free_decompressor(d);
-		} else {
+		if(lfh.compression_method != 0 && lfh.compression_method != 8) {
 			throw std::runtime_error("unsupported compression metod");
 		}
 
@@ -171,6 +187,57 @@ Zip::Zip(std::string const& path) {
 	}
 }
 
+std::string_view File::load() {
+	if(loaded) {
+		return content;
+	}
+	if(lfh.compression_method == 0) {
+		return lfh.data.substr(0, lfh.uncompressed_size);
+	}
+
+	if(lfh.compression_method == 8) {
+		content = std::string(lfh.uncompressed_size, '\0');
+
+		// Without actual size libdeflate fails on stream that doesn't fill
+		// uncompressed size exactly, so truncated entry isn't taken as content
+		auto d = libdeflate_alloc_decompressor();
+		// clang-format off
+		auto result = libdeflate_deflate_decompress(d,
+			lfh.data.data(), lfh.data.size(),
+			content.data(), content.size(),
+			nullptr
+		);
+		// clang-format on
+		libdeflate_free_decompressor(d);
+
+		if(result != LIBDEFLATE_SUCCESS) {
+			throw std::runtime_error(fmt::format("Can't decompress \"{}\"", lfh.file_name));
+		}
+	}
+
+	loaded = true;
+	return content;
+}
+
+void File::unload() {
+	if(loaded && !modified) {
+		content = std::string();
+		loaded = false;
+	}
+}
+
+void File::set_content(std::string str) {
+	if(load() == str) {
+		return;
+	}
+
+	content = std::move(str);
+	loaded = true;
+	lfh.uncompressed_size = static_cast<uint32_t>(content.size());
+	lfh.crc32 = crc32(content);
+	modified = true;
+}
+
 File* Zip::find_file(std::string const& fname) {
 	for(auto& file : files) {
 		if(file.lfh.file_name == fname) {
@@ -181,3 +248,261 @@ File* Zip::find_file(std::string const& fname) {
 	return nullptr;
 }
 
+// Buffered bytes and number of segments that trigger write
+static constexpr size_t flush_size = size_t(4) << 20;
+static constexpr size_t flush_segments = 256;
+
+ZipWriter::ZipWriter(std::string const& path) : path_(path) {
+	fd_ = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, 0666);
+	if(fd_ < 0) {
+		throw std::runtime_error(fmt::format("Can't create \"{}\"", path));
+	}
+}
+
+ZipWriter::ZipWriter(std::string* output) : path_("memory"), output_(output) {
+}
+
+ZipWriter::ZipWriter(int fd, std::string const& name) : fd_(fd), own_fd_(false), path_(name) {
+#ifdef _WIN32
+	_setmode(fd_, _O_BINARY);
+#endif
+}
+
+ZipWriter::~ZipWriter() {
+	if(fd_ >= 0 && own_fd_) {
+		close(fd_);
+	}
+}
+
+uint64_t ZipWriter::archive_size(std::vector<File> const& files,
+	std::vector<std::string_view> const& data,
+	EOCD const& eocd) {
+	uint64_t size = 22 + eocd.comment.size();
+	for(size_t i = 0; i < files.size(); ++i) {
+		LFH const& lfh = files[i].lfh;
+		CDFH const& cdfh = files[i].cdfh;
+		size += 30 + lfh.file_name.size() + lfh.extra_field.size() + data[i].size();
+		size += 46 + lfh.file_name.size() + cdfh.extra_field.size() + cdfh.file_comment.size();
+	}
+	return size;
+}
+
+void ZipWriter::preallocate(uint64_t size) {
+	if(output_) {
+		output_->reserve(output_->size() + size);
+		return;
+	}
+	if(!own_fd_) {
+		return;
+	}
+#if defined(__linux__)
+	// Unlike posix_fallocate() it never falls back to writing zeros, it just
+	// fails with EOPNOTSUPP where filesystem can't reserve space
+	if(fallocate(fd_, 0, 0, static_cast<off_t>(size)) == 0) {
+		reserved_ = size;
+	}
+#else
+	(void) size;
+#endif
+}
+
+void ZipWriter::add(File const& file, std::string_view data) {
+	LFH const& lfh = file.lfh;
+
+	entries_.emplace_back(&file, static_cast<uint32_t>(pos_));
+
+	put4(lfh.signature);
+	put2(lfh.version);
+	put2(lfh.bit_flag);
+	put2(lfh.compression_method);
+	put2(lfh.modification_time);
+	put2(lfh.modification_date);
+	put4(lfh.crc32);
+	put4(lfh.compressed_size);
+	put4(lfh.uncompressed_size);
+	put2(lfh.file_name_length);
+	put2(lfh.extra_field_length);
+
+	put(lfh.file_name);
+	put(lfh.extra_field);
+
+	put_data(data);
+}
+
+void ZipWriter::finish(EOCD const& eocd) {
+	uint32_t cdfh_pos = static_cast<uint32_t>(pos_);
+
+	for(auto const& [file, offset] : entries_) {
+		LFH const& lfh = file->lfh;
+		CDFH const& cdfh = file->cdfh;
+
+		put4(cdfh.signature);
+		put2(cdfh.version_made_by);
+		put2(cdfh.version_needed);
+
+		put2(lfh.bit_flag);
+		put2(lfh.compression_method);
+		put2(lfh.modification_time);
+		put2(lfh.modification_date);
+		put4(lfh.crc32);
+		put4(lfh.compressed_size);
+		put4(lfh.uncompressed_size);
+		put2(lfh.file_name_length);
+
+		put2(cdfh.extra_field_length);
+		put2(cdfh.file_comment_length);
+		put2(cdfh.disk_number);
+		put2(cdfh.internal_file_attributes);
+		put4(cdfh.external_file_attributes);
+		put4(offset);
+
+		put(lfh.file_name);
+		put(cdfh.extra_field);
+		put(cdfh.file_comment);
+	}
+
+	uint32_t cdfh_size = static_cast<uint32_t>(pos_) - cdfh_pos;
+
+	put4(eocd.signature);
+	put2(eocd.number_of_this_disk);
+	put2(eocd.central_directory_disk_no);
+	put2(eocd.entries_in_this_disk);
+	put2(eocd.total_entries);
+	put4(cdfh_size);
+	put4(cdfh_pos);
+	put2(eocd.comment_length);
+
+	put(eocd.comment);
+
+	flush();
+	if(output_ || !own_fd_) {
+		return;
+	}
+
+#ifndef _WIN32
+	// Drop reserved space that wasn't used
+	if(reserved_ > pos_ && ftruncate(fd_, static_cast<off_t>(pos_)) != 0) {
+		throw std::runtime_error(fmt::format("Can't write \"{}\"", path_));
+	}
+#endif
+
+	int fd = fd_;
+	fd_ = -1;
+	if(close(fd) != 0) {
+		throw std::runtime_error(fmt::format("Can't write \"{}\"", path_));
+	}
+}
+
+void ZipWriter::copy(std::string_view archive) {
+	put_data(archive);
+	flush();
+}
+
+void ZipWriter::put2(uint16_t value) {
+	const char v[] = {
+		static_cast<char>(value >> 0),
+		static_cast<char>(value >> 8),
+	};
+	put(std::string_view(v, 2));
+}
+
+void ZipWriter::put4(uint32_t value) {
+	const char v[] = {
+		static_cast<char>(value >> 0),
+		static_cast<char>(value >> 8),
+		static_cast<char>(value >> 16),
+		static_cast<char>(value >> 24),
+	};
+	put(std::string_view(v, 4));
+}
+
+// Records are appended to buffer, consecutive ones share one segment.
+void ZipWriter::put(std::string_view str) {
+	if(segments_.empty() || !segments_.back().data.empty()) {
+		segments_.push_back(Segment{buffer_.size(), buffer_.size(), {}});
+	}
+	buffer_.append(str);
+	segments_.back().end = buffer_.size();
+
+	pos_ += str.size();
+	pending_ += str.size();
+}
+
+// Entry data is written directly from where it is.
+void ZipWriter::put_data(std::string_view data) {
+	if(data.empty()) {
+		return;
+	}
+
+	segments_.push_back(Segment{0, 0, data});
+
+	pos_ += data.size();
+	pending_ += data.size();
+	if(pending_ >= flush_size || segments_.size() >= flush_segments) {
+		flush();
+	}
+}
+
+void ZipWriter::flush() {
+	if(output_) {
+		for(auto const& segment : segments_) {
+			output_->append(segment.data.empty() ? std::string_view(buffer_).substr(segment.begin, segment.end - segment.begin) : segment.data);
+		}
+	} else {
+		write_segments();
+	}
+
+	buffer_.clear();
+	segments_.clear();
+	pending_ = 0;
+}
+
+void ZipWriter::write_segments() {
+#ifdef _WIN32
+	for(auto const& segment : segments_) {
+		std::string_view data = segment.data.empty() ?
+			std::string_view(buffer_).substr(segment.begin, segment.end - segment.begin) :
+			segment.data;
+		while(!data.empty()) {
+			int written = _write(fd_, data.data(), static_cast<unsigned>(std::min(data.size(), size_t(1) << 30)));
+			if(written < 0) {
+				throw std::runtime_error(fmt::format("Can't write \"{}\"", path_));
+			}
+			data.remove_prefix(static_cast<size_t>(written));
+		}
+	}
+#else
+	std::vector<iovec> iov;
+	iov.reserve(segments_.size());
+	for(auto const& segment : segments_) {
+		if(segment.data.empty()) {
+			iov.push_back(iovec{&buffer_[segment.begin], segment.end - segment.begin});
+		} else {
+			iov.push_back(iovec{const_cast<char*>(segment.data.data()), segment.data.size()});
+		}
+	}
+
+	// writev may write only part of data
+	size_t i = 0;
+	while(i < iov.size()) {
+		int count = static_cast<int>(std::min(iov.size() - i, size_t(IOV_MAX)));
+		ssize_t written = writev(fd_, &iov[i], count);
+		if(written < 0) {
+			if(errno == EINTR) {
+				continue;
+			}
+			throw std::runtime_error(fmt::format("Can't write \"{}\"", path_));
+		}
+
+		size_t n = static_cast<size_t>(written);
+		while(i < iov.size() && n >= iov[i].iov_len) {
+			n -= iov[i].iov_len;
+			++i;
+		}
+		if(n > 0) {
+			iov[i].iov_base = static_cast<char*>(iov[i].iov_base) + n;
+			iov[i].iov_len -= n;
+		}
+	}
+#endif
+}